@@ -58,11 +58,12 @@ static void builder_state_init (BuilderState *bs)
   bs->ignore_text = FALSE;
   bs->prev_space = TRUE;
   bs->pre = FALSE;
+  bs->pre_start = FALSE;
   bs->parser = NULL;
   bs->uri = NULL;
   bs->queued_identifiers = NULL;
   bs->identifiers =
-    g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free);
   bs->anchor_handler_id = 0;
   bs->option_value = NULL;
   bs->ol_numbers = NULL;
@@ -118,28 +119,25 @@ static void builder_state_class_init (BuilderStateClass *klass)
   object_class->dispose = builder_state_dispose;
 }
 
-void scroll_to (BuilderState *bs, GObject *target)
+void scroll_to (BuilderState *bs, Anchor *target)
 {
-  GtkAllocation widget_alloc, *alloc;
-  if (GTK_IS_WIDGET(target)) {
-    gtk_widget_get_allocation(GTK_WIDGET(target), &widget_alloc);
-    alloc = &widget_alloc;
-  } else if (IS_IB_TEXT(target)) {
-    alloc = &IB_TEXT(target)->alloc;
+  GtkAllocation alloc;
+  if (target->child >= 0 && IS_INLINE_BOX(target->widget)) {
+    inline_box_get_child_allocation(INLINE_BOX(target->widget),
+                                    target->child, &alloc);
   } else {
-    puts("Shouldn't happen");
-    return;
+    gtk_widget_get_allocation(target->widget, &alloc);
   }
   GtkAdjustment *adj =
     gtk_scrolled_window_get_vadjustment(GTK_SCROLLED_WINDOW(bs->docbox));
-  gtk_adjustment_set_value(adj, alloc->y);
+  gtk_adjustment_set_value(adj, alloc.y);
   gtk_scrolled_window_set_vadjustment(GTK_SCROLLED_WINDOW(bs->docbox),
                                       adj);
 }
 
 void scroll_to_identifier(BuilderState *bs, const char *identifier)
 {
-  GObject *target = g_hash_table_lookup(bs->identifiers, identifier);
+  Anchor *target = g_hash_table_lookup(bs->identifiers, identifier);
   if (target != NULL) {
     scroll_to(bs, target);
   }
@@ -154,11 +152,35 @@ void browser_box_set_status(BrowserBox *bb, const gchar *status_str) {
 }
 
 void browser_box_display_search_status (BrowserBox *bb) {
-  gchar status[MAX_SEARCH_STRING_LEN + 33];
+  gchar status[MAX_SEARCH_STRING_LEN + 64];
+  gint len;
   if (bb->search_state == SEARCH_FORWARD) {
-    sprintf(status, "Forward search: %s", bb->search_string);
-    browser_box_set_status(bb, status);
+    len = sprintf(status, "%s search: %s",
+                  bb->search_regex ? "Regexp forward" : "Forward",
+                  bb->search_string);
+  } else if (bb->search_state == SEARCH_BACKWARD) {
+    len = sprintf(status, "%s search: %s",
+                  bb->search_regex ? "Regexp backward" : "Backward",
+                  bb->search_string);
+  } else {
+    return;
   }
+  if (bb->search_invalid) {
+    sprintf(status + len, " (invalid)");
+  } else if (bb->search_matches >= 0) {
+    sprintf(status + len, " (%d%s matches)", bb->search_matches,
+            bb->search_matches_done ? "" : "+");
+  }
+  browser_box_set_status(bb, status);
+}
+
+static void
+search_matches_cb (DocumentBox *db, guint count, gboolean done,
+                   BrowserBox *bb)
+{
+  bb->search_matches = count;
+  bb->search_matches_done = done;
+  browser_box_display_search_status(bb);
 }
 
 void image_set (SoupSession *session, SoupMessage *msg, ImageSetData *isd)
@@ -255,24 +277,28 @@ gboolean wck_equal (WordCacheKey *wck1, WordCacheKey *wck2)
 
 
 
-PangoLayout *get_layout(GtkWidget *widget, const gchar *text,
-                        PangoAttrList *attrs)
+/* Texts don't hold positions, so they are shared between all the
+   occurrences of a word with the same attributes. */
+IBText *get_text(GtkWidget *widget, const gchar *text,
+                 PangoAttrList *attrs)
 {
   WordCacheKey *wck = malloc(sizeof(WordCacheKey));
   wck->text = strdup(text);
   wck->attrs = attrs;
   pango_attr_list_ref(wck->attrs);
-  PangoLayout *pl = g_hash_table_lookup(word_cache, wck);
-  if (pl == NULL) {
-    pl = gtk_widget_create_pango_layout(widget, text);
+  IBText *ibt = g_hash_table_lookup(word_cache, wck);
+  if (ibt == NULL) {
+    PangoLayout *pl = gtk_widget_create_pango_layout(widget, text);
     pango_layout_set_attributes(pl, attrs);
-    g_hash_table_insert(word_cache, wck, pl);
+    ibt = ib_text_new(pl);
+    g_object_unref(pl);
+    g_hash_table_insert(word_cache, wck, ibt);
   } else {
     free(wck->text);
     pango_attr_list_unref(wck->attrs);
     free(wck);
   }
-  return pl;
+  return ibt;
 }
 
 PangoAttrList *shift_attributes(PangoAttrList *src_attrs, guint len)
@@ -346,6 +372,7 @@ void ensure_inline_box (BuilderState *bs)
   if (! IS_INLINE_BOX(bs->stack->data)) {
     if (GTK_IS_CONTAINER(bs->stack->data)) {
       InlineBox *ib = inline_box_new();
+      ib->focus_chain = bs->docbox->focus_chain;
       bs->text_position = 0;
       gtk_container_add (GTK_CONTAINER (bs->stack->data), GTK_WIDGET (ib));
       gtk_widget_show_all (GTK_WIDGET(ib));
@@ -376,9 +403,19 @@ IBText *add_word(BuilderState *bs, gchar *word, PangoAttrList **attrs)
   InlineBox *ib = bs->stack->data;
   IBText *ibt = NULL;
   if (word[0] != 0) {
-    PangoLayout *pl = get_layout(GTK_WIDGET(ib), word, *attrs);
-    ibt = ib_text_new(pl);
-    inline_box_add_text(ib, ibt);
+    if (bs->pre) {
+      /* Preformatted lines are rarely repeated, so they are not
+         cached. */
+      PangoLayout *pl = gtk_widget_create_pango_layout(GTK_WIDGET(ib), word);
+      pango_layout_set_attributes(pl, *attrs);
+      ibt = ib_text_new(pl);
+      g_object_unref(pl);
+      inline_box_add_text(ib, ibt);
+      g_object_unref(ibt);
+    } else {
+      ibt = get_text(GTK_WIDGET(ib), word, *attrs);
+      inline_box_add_text(ib, ibt);
+    }
     *attrs = shift_attributes(*attrs, strlen(word));
     if (bs->queued_identifiers) {
       GSList *ii;
@@ -390,7 +427,10 @@ IBText *add_word(BuilderState *bs, gchar *word, PangoAttrList **attrs)
             g_signal_connect (ib, "size-allocate",
                               G_CALLBACK(anchor_allocated), bs);
         }
-        g_hash_table_insert(bs->identifiers, ii->data, ibt);
+        Anchor *anchor = malloc(sizeof(Anchor));
+        anchor->widget = GTK_WIDGET(ib);
+        anchor->child = ib->children_count - 1;
+        g_hash_table_insert(bs->identifiers, ii->data, anchor);
       }
       g_slist_free(bs->queued_identifiers);
       bs->queued_identifiers = NULL;
@@ -399,6 +439,49 @@ IBText *add_word(BuilderState *bs, gchar *word, PangoAttrList **attrs)
   return ibt;
 }
 
+/* Adds a word, splitting it into units at line break opportunities
+   if it's not plain ASCII: scripts such as CJK don't separate words
+   with spaces, and such units can wrap and be cached. */
+void add_words(BuilderState *bs, gchar *word, PangoAttrList **attrs)
+{
+  gchar *p;
+  for (p = word; *p != 0 && (guchar)*p < 0x80; p++);
+  if (bs->pre || *p == 0) {
+    add_word(bs, word, attrs);
+    return;
+  }
+  glong i, chars = g_utf8_strlen(word, -1);
+  PangoLogAttr *log_attrs = g_new(PangoLogAttr, chars + 1);
+  pango_get_log_attrs(word, -1, -1, pango_language_get_default(),
+                      log_attrs, chars + 1);
+  gchar *start = word;
+  for (i = 1, p = g_utf8_next_char(word); i < chars;
+       i++, p = g_utf8_next_char(p)) {
+    if (log_attrs[i].is_line_break) {
+      gchar c = *p;
+      *p = 0;
+      add_word(bs, start, attrs);
+      *p = c;
+      start = p;
+    }
+  }
+  add_word(bs, start, attrs);
+  g_free(log_attrs);
+}
+
+/* Collapsible spaces are attached to preceding words, unless there
+   are none. */
+void add_space(BuilderState *bs, PangoAttrList **attrs)
+{
+  ensure_inline_box(bs);
+  InlineBox *ib = bs->stack->data;
+  if (inline_box_add_space(ib, get_text(GTK_WIDGET(ib), " ", *attrs))) {
+    *attrs = shift_attributes(*attrs, 1);
+  } else {
+    add_word(bs, " ", attrs);
+  }
+}
+
 
 
 
@@ -503,10 +586,30 @@ void sax_characters (BrowserBox *bb, const xmlChar * ch, int len)
   ensure_inline_box(bs);
 
   gint i = 0, j = 0;
+  /* Carriage returns are dropped from preformatted text, leaving CRLF
+     line ends as plain newlines. */
+  if (bs->pre) {
+    for (i = 0; i < len; i++) {
+      if (value[i] != '\r') {
+        value[j++] = value[i];
+      }
+    }
+    value[j] = 0;
+    len = j;
+    i = j = 0;
+  }
+  /* A newline right after the <pre> start tag is ignored. */
+  if (bs->pre_start && len > 0) {
+    bs->pre_start = FALSE;
+    if (value[0] == '\n') {
+      i = j = 1;
+    }
+  }
   while (i < len) {
-    if (value[i] == ' ' || value[i] == '\n' ||
-        value[i] == '\r' || value[i] == '\t') {
-      gchar c = value[i];
+    if (bs->pre && value[i] != '\n') {
+      /* Preformatted lines are added as whole texts. */
+    } else if (value[i] == ' ' || value[i] == '\n' ||
+               value[i] == '\r' || value[i] == '\t') {
       value[i] = 0;
       if (bs->current_word != NULL) {
         bs->current_word =
@@ -514,21 +617,19 @@ void sax_characters (BrowserBox *bb, const xmlChar * ch, int len)
                   strlen(bs->current_word) + strlen(value + j) + 1);
         g_strlcpy(bs->current_word + strlen(bs->current_word),
                   value + j, strlen(value + j) + 1);
-        add_word(bs, bs->current_word, &bs->current_attrs);
+        add_words(bs, bs->current_word, &bs->current_attrs);
         free(bs->current_word);
         bs->current_word = NULL;
       } else {
-        add_word(bs, value + j, &bs->current_attrs);
+        add_words(bs, value + j, &bs->current_attrs);
       }
       bs->text_position += strlen(value + j);
-      if (bs->pre && c == '\n') {
+      if (bs->pre) {
         inline_box_break(INLINE_BOX(bs->stack->data));
-      } else {
-        if (bs->pre || ! bs->prev_space) {
-          add_word(bs, " ", &bs->current_attrs);
-          bs->text_position += 1;
-          bs->prev_space = TRUE;
-        }
+      } else if (! bs->prev_space) {
+        add_space(bs, &bs->current_attrs);
+        bs->text_position += 1;
+        bs->prev_space = TRUE;
       }
       j = i + 1;
     } else {
@@ -551,437 +652,765 @@ void sax_characters (BrowserBox *bb, const xmlChar * ch, int len)
   free(value);
 }
 
-gboolean element_is_blocking (const char *name)
+/* Elements are looked up once per start or end tag, and dispatched
+   by their properties and handlers, instead of comparing names
+   repeatedly. */
+
+typedef enum _Element Element;
+enum _Element {
+  ELEMENT_OTHER,
+  ELEMENT_A,
+  ELEMENT_B,
+  ELEMENT_BR,
+  ELEMENT_CODE,
+  ELEMENT_DD,
+  ELEMENT_DL,
+  ELEMENT_DT,
+  ELEMENT_EM,
+  ELEMENT_FORM,
+  ELEMENT_H1,
+  ELEMENT_H2,
+  ELEMENT_H3,
+  ELEMENT_H4,
+  ELEMENT_H5,
+  ELEMENT_H6,
+  ELEMENT_HEAD,
+  ELEMENT_I,
+  ELEMENT_IMG,
+  ELEMENT_INPUT,
+  ELEMENT_LI,
+  ELEMENT_OL,
+  ELEMENT_OPTION,
+  ELEMENT_P,
+  ELEMENT_PRE,
+  ELEMENT_SCRIPT,
+  ELEMENT_SELECT,
+  ELEMENT_STRONG,
+  ELEMENT_STYLE,
+  ELEMENT_SUB,
+  ELEMENT_SUP,
+  ELEMENT_TABLE,
+  ELEMENT_TD,
+  ELEMENT_TH,
+  ELEMENT_TR,
+  ELEMENT_UL
+};
+
+/* Element properties: blocking elements end inline boxes (not
+   including <div> elements: the results of their inclusion aren't
+   always good, and according to the specification they have no
+   special meaning at all), elements flushing text end the current
+   word, inline ones need an inline box, and the text of ignored ones
+   isn't shown. */
+#define EP_BLOCKING (1 << 0)
+#define EP_FLUSHES_TEXT (1 << 1)
+#define EP_INLINE (1 << 2)
+#define EP_IGNORED (1 << 3)
+
+/* Attributes the builder is interested in, collected in a single
+   pass over them. The last occurrence of an attribute wins. */
+typedef struct _ElementAttrs ElementAttrs;
+struct _ElementAttrs
+{
+  const gchar *action;
+  const gchar *colspan;
+  const gchar *enctype;
+  const gchar *href;
+  const gchar *id;
+  const gchar *method;
+  const gchar *name;
+  const gchar *rowspan;
+  const gchar *src;
+  const gchar *type;
+  const gchar *value;
+};
+
+typedef void (*ElementHandler) (BrowserBox *bb, Element element,
+                                const ElementAttrs *ea);
+
+typedef struct _ElementInfo ElementInfo;
+struct _ElementInfo
+{
+  const gchar *name;
+  Element element;
+  guint flags;
+  ElementHandler start;
+  ElementHandler end;
+};
+
+static void
+element_attrs_scan (const xmlChar **attrs, ElementAttrs *ea)
+{
+  guint i;
+  memset(ea, 0, sizeof(ElementAttrs));
+  if (attrs == NULL) {
+    return;
+  }
+  for (i = 0; attrs[i]; i += 2) {
+    const char *key = (const char*)attrs[i];
+    const gchar *value = (const char*)attrs[i + 1];
+    switch (key[0]) {
+    case 'a':
+      if (strcmp(key, "action") == 0) {
+        ea->action = value;
+      }
+      break;
+    case 'c':
+      if (strcmp(key, "colspan") == 0) {
+        ea->colspan = value;
+      }
+      break;
+    case 'e':
+      if (strcmp(key, "enctype") == 0) {
+        ea->enctype = value;
+      }
+      break;
+    case 'h':
+      if (strcmp(key, "href") == 0) {
+        ea->href = value;
+      }
+      break;
+    case 'i':
+      if (strcmp(key, "id") == 0) {
+        ea->id = value;
+      }
+      break;
+    case 'm':
+      if (strcmp(key, "method") == 0) {
+        ea->method = value;
+      }
+      break;
+    case 'n':
+      if (strcmp(key, "name") == 0) {
+        ea->name = value;
+      }
+      break;
+    case 'r':
+      if (strcmp(key, "rowspan") == 0) {
+        ea->rowspan = value;
+      }
+      break;
+    case 's':
+      if (strcmp(key, "src") == 0) {
+        ea->src = value;
+      }
+      break;
+    case 't':
+      if (strcmp(key, "type") == 0) {
+        ea->type = value;
+      }
+      break;
+    case 'v':
+      if (strcmp(key, "value") == 0) {
+        ea->value = value;
+      }
+      break;
+    }
+  }
+}
+
+static guint
+current_word_length (BuilderState *bs)
 {
-  /* Not including <div> elements: the results of their inclusion
-     aren't always good, and according to the specification they have
-     no special meaning at all. */
-  return (strcmp(name, "p") == 0 ||
-          strcmp(name, "h1") == 0 || strcmp(name, "h2") == 0 ||
-          strcmp(name, "h3") == 0 || strcmp(name, "h4") == 0 ||
-          strcmp(name, "h5") == 0 || strcmp(name, "h6") == 0 ||
-          strcmp(name, "pre") == 0 || strcmp(name, "ul") == 0 ||
-          strcmp(name, "ol") == 0 || strcmp(name, "li") == 0 ||
-          strcmp(name, "dl") == 0 || strcmp(name, "dt") == 0 ||
-          strcmp(name, "dd") == 0 || strcmp(name, "table") == 0 ||
-          strcmp(name, "td") == 0 || strcmp(name, "th") == 0 ||
-          strcmp(name, "tr") == 0
-          );
+  return bs->current_word == NULL ? 0 : strlen(bs->current_word);
 }
 
-gboolean element_flushes_text (const char *name)
+/* Pops the box an element has pushed onto the stack, if any is left
+   under it. */
+static void
+stack_pop (BuilderState *bs)
 {
-  return (element_is_blocking (name) ||
-          (strcmp(name, "br") == 0 || strcmp(name, "img") == 0 ||
-           strcmp(name, "input") == 0 || strcmp(name, "select") == 0
-           ));
+  GSList *next = bs->stack->next;
+  if (next != NULL) {
+    g_slist_free_1(bs->stack);
+    bs->stack = next;
+  }
 }
 
-void sax_start_element (BrowserBox *bb,
-                        const xmlChar * u_name,
-                        const xmlChar ** attrs)
+
+/* Start handlers */
+
+static void
+start_list (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  BuilderState *bs = bb->builder_state;
+  if (! IS_BLOCK_BOX(bs->stack->data)) {
+    return;
+  }
+  /* todo: maybe use a dedicated widget for ul and ol */
+  GtkWidget *dl = block_box_new(0);
+  gtk_container_add (GTK_CONTAINER (bs->stack->data), GTK_WIDGET (dl));
+  gtk_widget_show_all(dl);
+  bs->stack = g_slist_prepend(bs->stack, dl);
+  if (element == ELEMENT_OL || element == ELEMENT_UL) {
+    guint *num = malloc(sizeof(guint));
+    *num = (element == ELEMENT_OL) ? 1 : 0;
+    bs->ol_numbers = g_slist_prepend(bs->ol_numbers, num);
+  }
+}
+
+static void
+start_dd (BrowserBox *bb, Element element, const ElementAttrs *ea)
 {
   BuilderState *bs = bb->builder_state;
-  const char *name = (const char*)u_name;
+  if (! IS_BLOCK_BOX(bs->stack->data)) {
+    return;
+  }
+  GtkWidget *dd = block_box_new(10);
+  gtk_container_add (GTK_CONTAINER (bs->stack->data), GTK_WIDGET (dd));
+  gtk_widget_show_all(dd);
+  bs->stack = g_slist_prepend(bs->stack, dd);
+  gtk_widget_set_margin_start(bs->stack->data, 32);
+}
 
-  if (IS_INLINE_BOX(bs->stack->data)) {
-    if (element_flushes_text(name)) {
-      if (bs->current_word != NULL) {
-        add_word(bs, bs->current_word, &bs->current_attrs);
-        free(bs->current_word);
-        bs->current_word = NULL;
-      }
-      bs->prev_space = TRUE;
-    }
-    if (element_is_blocking(name)) {
-      GSList *next = bs->stack->next;
-      if (next != NULL) {
-        g_slist_free_1(bs->stack);
-        bs->stack = next;
-      }
+static void
+start_li (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  BuilderState *bs = bb->builder_state;
+  if (! (IS_BLOCK_BOX(bs->stack->data) && bs->ol_numbers)) {
+    return;
+  }
+  GtkWidget *hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+  gchar *str;
+  guint num = *((guint*)bs->ol_numbers->data);
+  if (num == 0) {
+    str = "*";
+  } else {
+    str = g_strdup_printf("%u.", num);
+    *((guint*)bs->ol_numbers->data) = num + 1;
+  }
+  GtkWidget *lbl = gtk_label_new(str);
+  if (num > 0) {
+    g_free(str);
+  }
+  GtkWidget *vbox = block_box_new(10);
+  gtk_widget_set_valign(lbl, GTK_ALIGN_START);
+  gtk_container_add (GTK_CONTAINER (hbox), GTK_WIDGET (lbl));
+  gtk_container_add (GTK_CONTAINER (hbox), GTK_WIDGET (vbox));
+  gtk_container_add (GTK_CONTAINER (bs->stack->data), hbox);
+  gtk_widget_show_all(hbox);
+  bs->stack = g_slist_prepend(bs->stack, hbox);
+  bs->stack = g_slist_prepend(bs->stack, vbox);
+}
+
+static void
+start_table (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  BuilderState *bs = bb->builder_state;
+  if (! IS_BLOCK_BOX(bs->stack->data)) {
+    return;
+  }
+  GtkWidget *tb = table_box_new();
+  gtk_container_add (GTK_CONTAINER (bs->stack->data), tb);
+  gtk_widget_show_all(tb);
+  bs->stack = g_slist_prepend(bs->stack, tb);
+}
+
+static void
+start_pre (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  BuilderState *bs = bb->builder_state;
+  if (! IS_BLOCK_BOX(bs->stack->data)) {
+    return;
+  }
+  InlineBox *ib = inline_box_new();
+  ib->focus_chain = bs->docbox->focus_chain;
+  bs->text_position = 0;
+  ib->wrap = FALSE;
+  gtk_container_add (GTK_CONTAINER (bs->stack->data), GTK_WIDGET (ib));
+  gtk_widget_show_all(GTK_WIDGET(ib));
+  bs->stack = g_slist_prepend(bs->stack, ib);
+  bs->pre = TRUE;
+  bs->pre_start = TRUE;
+  attribute_start(bs->current_attrs, pango_attr_family_new("mono"), 0);
+}
+
+static void
+start_tr (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  BuilderState *bs = bb->builder_state;
+  if (IS_TABLE_BOX(bs->stack->data)) {
+    table_box_add_row(bs->stack->data);
+  }
+}
+
+static void
+start_cell (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  BuilderState *bs = bb->builder_state;
+  if (! (IS_TABLE_BOX(bs->stack->data) &&
+         TABLE_BOX(bs->stack->data)->rows != NULL)) {
+    return;
+  }
+  GtkWidget *tc = table_cell_new();
+  if (ea->rowspan != NULL) {
+    sscanf(ea->rowspan, "%u", &(TABLE_CELL(tc)->rowspan));
+    if (TABLE_CELL(tc)->rowspan > 65534) {
+      TABLE_CELL(tc)->rowspan = 65534;
+    } else if (TABLE_CELL(tc)->rowspan == 0) {
+      TABLE_CELL(tc)->rowspan = 1;
     }
-    /* Line breaks */
-    if (strcmp(name, "br") == 0) {
-      inline_box_break(INLINE_BOX(bs->stack->data));
+  }
+  if (ea->colspan != NULL) {
+    sscanf(ea->colspan, "%u", &(TABLE_CELL(tc)->colspan));
+    if (TABLE_CELL(tc)->colspan > 65534) {
+      TABLE_CELL(tc)->colspan = 65534;
+    } else if (TABLE_CELL(tc)->colspan == 0) {
+      TABLE_CELL(tc)->colspan = 1;
     }
   }
+  gtk_container_add (GTK_CONTAINER (bs->stack->data), tc);
+  gtk_widget_show_all(tc);
+  bs->stack = g_slist_prepend(bs->stack, tc);
+}
 
-  if (IS_BLOCK_BOX(bs->stack->data)) {
-    /* Elements that (may) need inline boxes */
-    if (strcmp(name, "a") == 0 ||
-        strcmp(name, "br") == 0 ||
-        strcmp(name, "img") == 0 ||
-        strcmp(name, "select") == 0 ||
-        strcmp(name, "input") == 0) {
-      ensure_inline_box(bs);
+static void
+start_img (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  BuilderState *bs = bb->builder_state;
+  if (! IS_INLINE_BOX(bs->stack->data) || ea->src == NULL) {
+    return;
+  }
+  GtkWidget *image = gtk_image_new_from_file(NULL);
+  if (image != NULL) {
+    /* todo: progressive image loading */
+    gtk_container_add (GTK_CONTAINER (bs->stack->data), image);
+    gtk_widget_show_all(image);
+
+    SoupURI *uri = soup_uri_new_with_base(bs->uri, ea->src);
+    SoupMessage *sm = soup_message_new_from_uri("GET", uri);
+    soup_uri_free(uri);
+    ImageSetData *isd = malloc(sizeof(ImageSetData));
+    isd->image = GTK_IMAGE(image);
+    isd->bs = bs;
+    g_object_ref(bs);
+    soup_session_queue_message(bb->soup_session, sm,
+                               (SoupSessionCallback)image_set, isd);
+    if (bs->current_link != NULL) {
+      inline_box_add_link_widget(INLINE_BOX(bs->stack->data),
+                                 bs->current_link, image);
     }
   }
+}
 
-  if (IS_BLOCK_BOX(bs->stack->data)) {
-    /* Lists */
-    if (strcmp(name, "dl") == 0 || strcmp(name, "ul") == 0 ||
-        strcmp(name, "ol") == 0) {
-      /* todo: maybe use a dedicated widget for ul and ol */
-      GtkWidget *dl = block_box_new(0);
-      gtk_container_add (GTK_CONTAINER (bs->stack->data), GTK_WIDGET (dl));
-      gtk_widget_show_all(dl);
-      bs->stack = g_slist_prepend(bs->stack, dl);
-      if ((strcmp(name, "ol") == 0) || (strcmp(name, "ul") == 0)) {
-        guint *num = malloc(sizeof(guint));
-        if (strcmp(name, "ol") == 0) {
-          *num = 1;
-        } else if (strcmp(name, "ul") == 0) {
-          *num = 0;
-        }
-        bs->ol_numbers = g_slist_prepend(bs->ol_numbers, num);
-      }
+static void
+start_input (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  BuilderState *bs = bb->builder_state;
+  if (! IS_INLINE_BOX(bs->stack->data)) {
+    return;
+  }
+  GtkWidget *input = NULL;
+  if (g_strcmp0(ea->type, "submit") == 0) {
+    input =
+      gtk_button_new_with_label(ea->value == NULL ? "submit" : ea->value);
+    if (bs->current_form != NULL) {
+      g_signal_connect (input, "clicked",
+                        G_CALLBACK(form_submit), bs->current_form);
     }
-
-    if (strcmp(name, "dd") == 0) {
-      GtkWidget *dd = block_box_new(10);
-      gtk_container_add (GTK_CONTAINER (bs->stack->data), GTK_WIDGET (dd));
-      gtk_widget_show_all(dd);
-      bs->stack = g_slist_prepend(bs->stack, dd);
-      gtk_widget_set_margin_start(bs->stack->data, 32);
+  } else if (g_strcmp0(ea->type, "checkbox") == 0) {
+    input = gtk_check_button_new();
+  } else {
+    /* Defaulting to type=text */
+    input = gtk_entry_new();
+    if (ea->value != NULL) {
+      gtk_entry_set_text(GTK_ENTRY(input), ea->value);
     }
-
-    if (bs->ol_numbers) {
-      if (strcmp(name, "li") == 0) {
-        GtkWidget *hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
-        gchar *str;
-        guint num = *((guint*)bs->ol_numbers->data);
-        if (num == 0) {
-          str = "*";
-        } else {
-          str = g_strdup_printf("%u.", num);
-          *((guint*)bs->ol_numbers->data) = num + 1;
-        }
-        GtkWidget *lbl = gtk_label_new(str);
-        if (num > 0) {
-          g_free(str);
-        }
-        GtkWidget *vbox = block_box_new(10);
-        gtk_widget_set_valign(lbl, GTK_ALIGN_START);
-        gtk_container_add (GTK_CONTAINER (hbox), GTK_WIDGET (lbl));
-        gtk_container_add (GTK_CONTAINER (hbox), GTK_WIDGET (vbox));
-        gtk_container_add (GTK_CONTAINER (bs->stack->data), hbox);
-        gtk_widget_show_all(hbox);
-        bs->stack = g_slist_prepend(bs->stack, hbox);
-        bs->stack = g_slist_prepend(bs->stack, vbox);
-      }
+    if (bs->current_form != NULL) {
+      g_signal_connect (input, "activate",
+                        G_CALLBACK(form_submit), bs->current_form);
     }
-
-    /* Tables */
-    if (strcmp(name, "table") == 0) {
-      GtkWidget *tb = table_box_new();
-      gtk_container_add (GTK_CONTAINER (bs->stack->data), tb);
-      gtk_widget_show_all(tb);
-      bs->stack = g_slist_prepend(bs->stack, tb);
+  }
+  if (input != NULL) {
+    gtk_container_add (GTK_CONTAINER (bs->stack->data), input);
+    if (g_strcmp0(ea->type, "hidden") != 0) {
+      gtk_widget_show_all(input);
     }
+  }
+  if (input != NULL && bs->current_form != NULL && ea->name != NULL) {
+    FormField *ff = malloc(sizeof(FormField));
+    ff->name = strdup(ea->name);
+    ff->widget = input;
+    bs->current_form->fields = g_list_append(bs->current_form->fields, ff);
+  }
+}
 
-    /* Preformatted texts */
-    if (strcmp(name, "pre") == 0 && IS_BLOCK_BOX(bs->stack->data)) {
-      InlineBox *ib = inline_box_new();
-      bs->text_position = 0;
-      ib->wrap = FALSE;
-      gtk_container_add (GTK_CONTAINER (bs->stack->data), GTK_WIDGET (ib));
-      gtk_widget_show_all(GTK_WIDGET(ib));
-      bs->stack = g_slist_prepend(bs->stack, ib);
-      bs->pre = TRUE;
-      attribute_start(bs->current_attrs, pango_attr_family_new("mono"), 0);
-    }
+static void
+start_select (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  BuilderState *bs = bb->builder_state;
+  if (! IS_INLINE_BOX(bs->stack->data)) {
+    return;
+  }
+  GtkWidget *cbox = gtk_combo_box_text_new();
+  gtk_container_add (GTK_CONTAINER (bs->stack->data), cbox);
+  bs->stack = g_slist_prepend(bs->stack, cbox);
+  gtk_widget_show_all(cbox);
+  if (bs->current_form != NULL && ea->name != NULL) {
+    FormField *ff = malloc(sizeof(FormField));
+    ff->name = strdup(ea->name);
+    ff->widget = cbox;
+    bs->current_form->fields = g_list_append(bs->current_form->fields, ff);
   }
+}
 
-  if (IS_TABLE_BOX(bs->stack->data)) {
-    if (strcmp(name, "tr") == 0) {
-      table_box_add_row(bs->stack->data);
+static void
+start_option (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  BuilderState *bs = bb->builder_state;
+  if (GTK_IS_COMBO_BOX_TEXT(bs->stack->data) && ea->value != NULL) {
+    if (bs->option_value != NULL) {
+      free(bs->option_value);
     }
+    bs->option_value = strdup(ea->value);
+  }
+}
 
-    if (TABLE_BOX(bs->stack->data)->rows != NULL) {
-      if (strcmp(name, "td") == 0 || strcmp(name, "th") == 0) {
-        GtkWidget *tc = table_cell_new();
-        if (attrs != NULL) {
-          const gchar *rowspan = NULL, *colspan = NULL;
-          guint i;
-          for (i = 0; attrs[i]; i += 2){
-            if (g_strcmp0((const char*)attrs[i], "colspan") == 0) {
-              colspan = (const char*)attrs[i+1];
-            }
-            if (g_strcmp0((const char*)attrs[i], "rowspan") == 0) {
-              rowspan = (const char*)attrs[i+1];
-            }
-          }
-          if (rowspan != NULL) {
-            sscanf(rowspan, "%u", &(TABLE_CELL(tc)->rowspan));
-            if (TABLE_CELL(tc)->rowspan > 65534) {
-              TABLE_CELL(tc)->rowspan = 65534;
-            } else if (TABLE_CELL(tc)->rowspan == 0) {
-              TABLE_CELL(tc)->rowspan = 1;
-            }
-          }
-          if (colspan != NULL) {
-            sscanf(colspan, "%u", &(TABLE_CELL(tc)->colspan));
-            if (TABLE_CELL(tc)->colspan > 65534) {
-              TABLE_CELL(tc)->colspan = 65534;
-            } else if (TABLE_CELL(tc)->colspan == 0) {
-              TABLE_CELL(tc)->colspan = 1;
-            }
-          }
-        }
-        gtk_container_add (GTK_CONTAINER (bs->stack->data), tc);
-        gtk_widget_show_all(tc);
-        bs->stack = g_slist_prepend(bs->stack, tc);
-      }
-    }
+static void
+start_link (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  BuilderState *bs = bb->builder_state;
+  if (IS_INLINE_BOX(bs->stack->data) && ea->href != NULL) {
+    bs->current_link = ib_link_new(ea->href);
+    bs->current_link->start = bs->text_position;
+    inline_box_add_link(INLINE_BOX(bs->stack->data), bs->current_link);
   }
+  attribute_start(bs->current_attrs,
+                  pango_attr_foreground_new(bs->link_color.red * 65535,
+                                            bs->link_color.green * 65535,
+                                            bs->link_color.blue * 65535),
+                  current_word_length(bs));
+  attribute_start(bs->current_attrs,
+                  pango_attr_underline_new(PANGO_UNDERLINE_SINGLE),
+                  current_word_length(bs));
+}
 
-  /* Ignored */
-  if (strcmp(name, "head") == 0 || strcmp(name, "script") == 0 ||
-      strcmp(name, "style") == 0) {
-    bs->ignore_text = TRUE;
+static void
+start_form (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  BuilderState *bs = bb->builder_state;
+  Form *form = malloc(sizeof(Form));
+  form->submission_data = (gpointer)bb;
+  form->method = NULL;
+  form->enctype = ENCTYPE_URLENCODED;
+  form->action = NULL;
+  form->fields = NULL;
+  if (ea->method != NULL) {
+    form->method = strdup(ea->method);
+  }
+  if (g_strcmp0(ea->enctype, "multipart/form-data") == 0) {
+    form->enctype = ENCTYPE_MULTIPART;
+  } else if (g_strcmp0(ea->enctype, "text/plain") == 0) {
+    form->enctype = ENCTYPE_PLAIN;
+  }
+  if (ea->action == NULL) {
+    form->action = soup_uri_copy(bs->uri);
+  } else {
+    form->action = soup_uri_new_with_base(bs->uri, ea->action);
   }
+  bb->forms = g_list_prepend(bb->forms, form);
+  bs->current_form = form;
+}
 
-  /* Images */
-  if (IS_INLINE_BOX(bs->stack->data)) {
-    if (strcmp(name, "img") == 0) {
-      guint i;
-      const char *src = NULL;
-      if (attrs != NULL) {
-        for (i = 0; attrs[i]; i += 2){
-          if (strcmp((const char*)attrs[i], "src") == 0) {
-            src = (const char*)attrs[i+1];
-          }
-        }
-      }
-      if (src != NULL) {
-        GtkWidget *image = gtk_image_new_from_file(NULL);
-        if (image != NULL) {
-          /* todo: progressive image loading */
-          gtk_container_add (GTK_CONTAINER (bs->stack->data), image);
-          gtk_widget_show_all(image);
-
-          SoupURI *uri = soup_uri_new_with_base(bs->uri, src);
-          SoupMessage *sm = soup_message_new_from_uri("GET", uri);
-          soup_uri_free(uri);
-          ImageSetData *isd = malloc(sizeof(ImageSetData));
-          isd->image = GTK_IMAGE(image);
-          isd->bs = bs;
-          g_object_ref(bs);
-          soup_session_queue_message(bb->soup_session, sm,
-                                     (SoupSessionCallback)image_set, isd);
-          if (bs->current_link != NULL) {
-            bs->current_link->objects =
-              g_list_prepend(bs->current_link->objects, image);
-          }
-        }
-      }
-    }
+static void
+start_bold (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  BuilderState *bs = bb->builder_state;
+  attribute_start(bs->current_attrs,
+                  pango_attr_weight_new(PANGO_WEIGHT_BOLD),
+                  current_word_length(bs));
+}
 
-    /* Inputs */
-    if (strcmp(name, "input") == 0) {
-      guint i;
-      const char *type = NULL, *value = NULL, *a_name = NULL;
-      if (attrs != NULL) {
-        for (i = 0; attrs[i]; i += 2){
-          if (g_strcmp0((const char*)attrs[i], "type") == 0) {
-            type = (const char*)attrs[i+1];
-          }
-          if (g_strcmp0((const char*)attrs[i], "value") == 0) {
-            value = (const char*)attrs[i+1];
-          }
-          if (g_strcmp0((const char*)attrs[i], "name") == 0) {
-            a_name = (const char*)attrs[i+1];
-          }
-        }
-      }
-      GtkWidget *input = NULL;
-      if (g_strcmp0(type, "submit") == 0) {
-        input =
-          gtk_button_new_with_label(value == NULL ? "submit" : value);
-        if (bs->current_form != NULL) {
-          g_signal_connect (input, "clicked",
-                            G_CALLBACK(form_submit), bs->current_form);
-        }
-      } else if (g_strcmp0(type, "checkbox") == 0) {
-        input = gtk_check_button_new();
-      } else {
-        /* Defaulting to type=text */
-        input = gtk_entry_new();
-        if (value != NULL) {
-          gtk_entry_set_text(GTK_ENTRY(input), value);
-        }
-        if (bs->current_form != NULL) {
-          g_signal_connect (input, "activate",
-                            G_CALLBACK(form_submit), bs->current_form);
-        }
-      }
-      if (input != NULL) {
-        gtk_container_add (GTK_CONTAINER (bs->stack->data), input);
-        if (g_strcmp0(type, "hidden") != 0) {
-          gtk_widget_show_all(input);
-        }
-      }
-      if (input != NULL && bs->current_form != NULL && a_name != NULL) {
-        FormField *ff = malloc(sizeof(FormField));
-        ff->name = strdup(a_name);
-        ff->widget = input;
-        bs->current_form->fields = g_list_append(bs->current_form->fields, ff);
-      }
-    }
-    if (strcmp(name, "select") == 0) {
-      const gchar *a_name = NULL;
-      if (attrs != NULL) {
-        guint i;
-        for (i = 0; attrs[i]; i += 2){
-          if (g_strcmp0((const char*)attrs[i], "name") == 0) {
-            a_name = (const char*)attrs[i+1];
-          }
-        }
-      }
-      GtkWidget *cbox = gtk_combo_box_text_new();
-      gtk_container_add (GTK_CONTAINER (bs->stack->data), cbox);
-      bs->stack = g_slist_prepend(bs->stack, cbox);
-      gtk_widget_show_all(cbox);
-      if (bs->current_form != NULL && a_name != NULL) {
-        FormField *ff = malloc(sizeof(FormField));
-        ff->name = strdup(a_name);
-        ff->widget = cbox;
-        bs->current_form->fields = g_list_append(bs->current_form->fields, ff);
-      }
-    }
+static void
+start_italic (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  BuilderState *bs = bb->builder_state;
+  attribute_start(bs->current_attrs,
+                  pango_attr_style_new(PANGO_STYLE_ITALIC),
+                  current_word_length(bs));
+}
 
-    /* Links */
-    if (strcmp(name, "a") == 0) {
-      guint i;
-      const gchar *href = NULL;
-      if (attrs != NULL) {
-        for (i = 0; attrs[i]; i += 2){
-          if (strcmp((const char*)attrs[i], "href") == 0) {
-            href = (const char*)attrs[i+1];
-          }
-        }
-      }
-      if (href != NULL) {
-        bs->current_link = ib_link_new(href);
+static void
+start_code (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  BuilderState *bs = bb->builder_state;
+  attribute_start(bs->current_attrs,
+                  pango_attr_family_new("mono"),
+                  current_word_length(bs));
+}
 
-        bs->current_link->start = bs->text_position;
-        INLINE_BOX(bs->stack->data)->links =
-          g_list_append(INLINE_BOX(bs->stack->data)->links, bs->current_link);
-        bs->docbox->links = g_list_append(bs->docbox->links, bs->current_link);
-      }
+static void
+start_rise (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  BuilderState *bs = bb->builder_state;
+  /* todo: avoid using a constant */
+  attribute_start(bs->current_attrs,
+                  pango_attr_rise_new((element == ELEMENT_SUB ? -5 : 5)
+                                      * PANGO_SCALE),
+                  current_word_length(bs));
+  attribute_start(bs->current_attrs,
+                  pango_attr_scale_new(0.8),
+                  current_word_length(bs));
+}
+
+static void
+start_heading (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  static const double scales[] = { 1.8, 1.6, 1.4, 1.3, 1.2, 1.1 };
+  BuilderState *bs = bb->builder_state;
+  attribute_start(bs->current_attrs,
+                  pango_attr_scale_new(scales[element - ELEMENT_H1]),
+                  current_word_length(bs));
+  attribute_start(bs->current_attrs,
+                  pango_attr_weight_new(PANGO_WEIGHT_SEMIBOLD),
+                  current_word_length(bs));
+}
+
+
+/* End handlers */
+
+static void
+end_box (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  stack_pop(bb->builder_state);
+}
+
+static void
+end_list (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  BuilderState *bs = bb->builder_state;
+  stack_pop(bs);
+  if (bs->ol_numbers != NULL) {
+    GSList *next = bs->ol_numbers->next;
+    g_free(bs->ol_numbers->data);
+    g_slist_free_1(bs->ol_numbers);
+    bs->ol_numbers = next;
+  }
+}
+
+static void
+end_li (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  /* Both the item's box and the one holding it with the marker */
+  stack_pop(bb->builder_state);
+  stack_pop(bb->builder_state);
+}
+
+static void
+end_option (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  BuilderState *bs = bb->builder_state;
+  if (bs->option_value != NULL) {
+    free(bs->option_value);
+    bs->option_value = NULL;
+  }
+}
+
+static void
+end_table (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  if (IS_TABLE_BOX(bb->builder_state->stack->data)) {
+    stack_pop(bb->builder_state);
+  }
+}
+
+static void
+end_cell (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  if (IS_TABLE_CELL(bb->builder_state->stack->data)) {
+    stack_pop(bb->builder_state);
+  }
+}
+
+static void
+end_pre (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  BuilderState *bs = bb->builder_state;
+  bs->pre = FALSE;
+  bs->current_attrs = attribute_end(bs->current_attrs, PANGO_ATTR_FAMILY, 0);
+}
+
+static void
+end_link (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  BuilderState *bs = bb->builder_state;
+  bs->current_attrs = attribute_end(bs->current_attrs, PANGO_ATTR_FOREGROUND,
+                                    current_word_length(bs));
+  bs->current_attrs = attribute_end(bs->current_attrs, PANGO_ATTR_UNDERLINE,
+                                    current_word_length(bs));
+  if (bs->current_link != NULL) {
+    bs->current_link->end = bs->text_position;
+    bs->current_link = NULL;
+  }
+}
+
+static void
+end_form (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  bb->builder_state->current_form = NULL;
+}
+
+static void
+end_bold (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  BuilderState *bs = bb->builder_state;
+  bs->current_attrs = attribute_end(bs->current_attrs, PANGO_ATTR_WEIGHT,
+                                    current_word_length(bs));
+}
+
+static void
+end_italic (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  BuilderState *bs = bb->builder_state;
+  bs->current_attrs = attribute_end(bs->current_attrs, PANGO_ATTR_STYLE,
+                                    current_word_length(bs));
+}
+
+static void
+end_code (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  BuilderState *bs = bb->builder_state;
+  bs->current_attrs = attribute_end(bs->current_attrs, PANGO_ATTR_FAMILY,
+                                    current_word_length(bs));
+}
+
+static void
+end_rise (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  BuilderState *bs = bb->builder_state;
+  bs->current_attrs = attribute_end(bs->current_attrs, PANGO_ATTR_RISE,
+                                    current_word_length(bs));
+  bs->current_attrs = attribute_end(bs->current_attrs, PANGO_ATTR_SCALE,
+                                    current_word_length(bs));
+}
+
+static void
+end_heading (BrowserBox *bb, Element element, const ElementAttrs *ea)
+{
+  BuilderState *bs = bb->builder_state;
+  bs->current_attrs = attribute_end(bs->current_attrs, PANGO_ATTR_SCALE,
+                                    current_word_length(bs));
+  bs->current_attrs = attribute_end(bs->current_attrs, PANGO_ATTR_WEIGHT,
+                                    current_word_length(bs));
+}
+
+
+static const ElementInfo elements[] = {
+  { "a", ELEMENT_A, EP_INLINE, start_link, end_link },
+  { "b", ELEMENT_B, 0, start_bold, end_bold },
+  { "br", ELEMENT_BR, EP_INLINE | EP_FLUSHES_TEXT, NULL, NULL },
+  { "code", ELEMENT_CODE, 0, start_code, end_code },
+  { "dd", ELEMENT_DD, EP_BLOCKING | EP_FLUSHES_TEXT, start_dd, end_box },
+  { "dl", ELEMENT_DL, EP_BLOCKING | EP_FLUSHES_TEXT, start_list, end_box },
+  { "dt", ELEMENT_DT, EP_BLOCKING | EP_FLUSHES_TEXT, NULL, NULL },
+  { "em", ELEMENT_EM, 0, start_italic, end_italic },
+  { "form", ELEMENT_FORM, 0, start_form, end_form },
+  { "h1", ELEMENT_H1, EP_BLOCKING | EP_FLUSHES_TEXT,
+    start_heading, end_heading },
+  { "h2", ELEMENT_H2, EP_BLOCKING | EP_FLUSHES_TEXT,
+    start_heading, end_heading },
+  { "h3", ELEMENT_H3, EP_BLOCKING | EP_FLUSHES_TEXT,
+    start_heading, end_heading },
+  { "h4", ELEMENT_H4, EP_BLOCKING | EP_FLUSHES_TEXT,
+    start_heading, end_heading },
+  { "h5", ELEMENT_H5, EP_BLOCKING | EP_FLUSHES_TEXT,
+    start_heading, end_heading },
+  { "h6", ELEMENT_H6, EP_BLOCKING | EP_FLUSHES_TEXT,
+    start_heading, end_heading },
+  { "head", ELEMENT_HEAD, EP_IGNORED, NULL, NULL },
+  { "i", ELEMENT_I, 0, start_italic, end_italic },
+  { "img", ELEMENT_IMG, EP_INLINE | EP_FLUSHES_TEXT, start_img, NULL },
+  { "input", ELEMENT_INPUT, EP_INLINE | EP_FLUSHES_TEXT, start_input, NULL },
+  { "li", ELEMENT_LI, EP_BLOCKING | EP_FLUSHES_TEXT, start_li, end_li },
+  { "ol", ELEMENT_OL, EP_BLOCKING | EP_FLUSHES_TEXT, start_list, end_list },
+  { "option", ELEMENT_OPTION, 0, start_option, end_option },
+  { "p", ELEMENT_P, EP_BLOCKING | EP_FLUSHES_TEXT, NULL, NULL },
+  { "pre", ELEMENT_PRE, EP_BLOCKING | EP_FLUSHES_TEXT, start_pre, end_pre },
+  { "script", ELEMENT_SCRIPT, EP_IGNORED, NULL, NULL },
+  { "select", ELEMENT_SELECT, EP_INLINE | EP_FLUSHES_TEXT,
+    start_select, end_box },
+  { "strong", ELEMENT_STRONG, 0, start_bold, end_bold },
+  { "style", ELEMENT_STYLE, EP_IGNORED, NULL, NULL },
+  { "sub", ELEMENT_SUB, 0, start_rise, end_rise },
+  { "sup", ELEMENT_SUP, 0, start_rise, end_rise },
+  { "table", ELEMENT_TABLE, EP_BLOCKING | EP_FLUSHES_TEXT,
+    start_table, end_table },
+  { "td", ELEMENT_TD, EP_BLOCKING | EP_FLUSHES_TEXT, start_cell, end_cell },
+  { "th", ELEMENT_TH, EP_BLOCKING | EP_FLUSHES_TEXT, start_cell, end_cell },
+  { "tr", ELEMENT_TR, EP_BLOCKING | EP_FLUSHES_TEXT, start_tr, NULL },
+  { "ul", ELEMENT_UL, EP_BLOCKING | EP_FLUSHES_TEXT, start_list, end_list }
+};
+
+static const ElementInfo other_element = {
+  NULL, ELEMENT_OTHER, 0, NULL, NULL
+};
+
+/* Element names are hashed into a table built on first use. */
+static const ElementInfo *
+element_info (const char *name)
+{
+  static GHashTable *table = NULL;
+  const ElementInfo *info;
+  if (table == NULL) {
+    guint i;
+    table = g_hash_table_new(g_str_hash, g_str_equal);
+    for (i = 0; i < G_N_ELEMENTS(elements); i++) {
+      g_hash_table_insert(table, (gpointer)elements[i].name,
+                          (gpointer)&elements[i]);
     }
   }
-  if (GTK_IS_COMBO_BOX_TEXT(bs->stack->data)) {
-    if (strcmp(name, "option") == 0) {
-      guint i;
-      if (attrs != NULL) {
-        for (i = 0; attrs[i]; i += 2) {
-          if (strcmp((const char*)attrs[i], "value") == 0) {
-            if (bs->option_value != NULL) {
-              free(bs->option_value);
-            }
-            bs->option_value = strdup((const char*)attrs[i+1]);
-          }
-        }
+  info = g_hash_table_lookup(table, name);
+  return info != NULL ? info : &other_element;
+}
+
+void sax_start_element (BrowserBox *bb,
+                        const xmlChar * u_name,
+                        const xmlChar ** attrs)
+{
+  BuilderState *bs = bb->builder_state;
+  const ElementInfo *info = element_info((const char*)u_name);
+  ElementAttrs ea;
+  element_attrs_scan(attrs, &ea);
+
+  if (IS_INLINE_BOX(bs->stack->data)) {
+    if (info->flags & EP_FLUSHES_TEXT) {
+      if (bs->current_word != NULL) {
+        add_words(bs, bs->current_word, &bs->current_attrs);
+        free(bs->current_word);
+        bs->current_word = NULL;
       }
+      bs->prev_space = TRUE;
+    }
+    if (info->flags & EP_BLOCKING) {
+      stack_pop(bs);
+    }
+    /* Line breaks */
+    if (info->element == ELEMENT_BR) {
+      inline_box_break(INLINE_BOX(bs->stack->data));
     }
   }
 
+  /* Elements that (may) need inline boxes */
+  if (IS_BLOCK_BOX(bs->stack->data) && (info->flags & EP_INLINE)) {
+    ensure_inline_box(bs);
+  }
+
+  if (info->start != NULL) {
+    info->start(bb, info->element, &ea);
+  }
 
-  /* Formatting */
-  if (strcmp(name, "b") == 0 || strcmp(name, "strong") == 0) {
-    attribute_start(bs->current_attrs,
-                    pango_attr_weight_new(PANGO_WEIGHT_BOLD),
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-  } else if (strcmp(name, "i") == 0 || strcmp(name, "em") == 0) {
-    attribute_start(bs->current_attrs,
-                    pango_attr_style_new(PANGO_STYLE_ITALIC),
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-  } else if (strcmp(name, "code") == 0) {
-    attribute_start(bs->current_attrs,
-                    pango_attr_family_new("mono"),
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-  } else if (strcmp(name, "sub") == 0) {
-    /* todo: avoid using a constant */
-    attribute_start(bs->current_attrs,
-                    pango_attr_rise_new(-5 * PANGO_SCALE),
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-    attribute_start(bs->current_attrs,
-                    pango_attr_scale_new(0.8),
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-  } else if (strcmp(name, "sup") == 0) {
-    /* todo: avoid using a constant */
-    attribute_start(bs->current_attrs,
-                    pango_attr_rise_new(5 * PANGO_SCALE),
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-    attribute_start(bs->current_attrs,
-                    pango_attr_scale_new(0.8),
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-  } else if (strcmp(name, "h1") == 0) {
-    attribute_start(bs->current_attrs,
-                    pango_attr_scale_new(1.8),
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-    attribute_start(bs->current_attrs,
-                    pango_attr_weight_new(PANGO_WEIGHT_SEMIBOLD),
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-  } else if (strcmp(name, "h2") == 0) {
-    attribute_start(bs->current_attrs,
-                    pango_attr_scale_new(1.6),
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-    attribute_start(bs->current_attrs,
-                    pango_attr_weight_new(PANGO_WEIGHT_SEMIBOLD),
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-  } else if (strcmp(name, "h3") == 0) {
-    attribute_start(bs->current_attrs,
-                    pango_attr_scale_new(1.4),
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-    attribute_start(bs->current_attrs,
-                    pango_attr_weight_new(PANGO_WEIGHT_SEMIBOLD),
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-  } else if (strcmp(name, "h4") == 0) {
-    attribute_start(bs->current_attrs,
-                    pango_attr_scale_new(1.3),
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-    attribute_start(bs->current_attrs,
-                    pango_attr_weight_new(PANGO_WEIGHT_SEMIBOLD),
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-  } else if (strcmp(name, "h5") == 0) {
-    attribute_start(bs->current_attrs,
-                    pango_attr_scale_new(1.2),
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-    attribute_start(bs->current_attrs,
-                    pango_attr_weight_new(PANGO_WEIGHT_SEMIBOLD),
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-  } else if (strcmp(name, "h6") == 0) {
-    attribute_start(bs->current_attrs,
-                    pango_attr_scale_new(1.1),
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-    attribute_start(bs->current_attrs,
-                    pango_attr_weight_new(PANGO_WEIGHT_SEMIBOLD),
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-  } else if (strcmp(name, "a") == 0) {
-    attribute_start(bs->current_attrs,
-                    pango_attr_foreground_new(bs->link_color.red * 65535,
-                                              bs->link_color.green * 65535,
-                                              bs->link_color.blue * 65535),
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-    attribute_start(bs->current_attrs,
-                    pango_attr_underline_new(PANGO_UNDERLINE_SINGLE),
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
+  if (info->flags & EP_IGNORED) {
+    bs->ignore_text = TRUE;
   }
 
   /* Identifiers */
-  if (attrs != NULL) {
-    guint i;
-    for (i = 0; attrs[i]; i += 2){
-      if (strcmp((const char*)attrs[i], "id") == 0 ||
-          (strcmp(name, "a") == 0 &&
-           strcmp((const char*)attrs[i], "name") == 0)) {
-        bs->queued_identifiers =
-          g_slist_prepend(bs->queued_identifiers,
-                          strdup((const char*)attrs[i + 1]));
-      }
-    }
+  if (ea.id != NULL) {
+    bs->queued_identifiers =
+      g_slist_prepend(bs->queued_identifiers, strdup(ea.id));
+  }
+  if (info->element == ELEMENT_A && ea.name != NULL) {
+    bs->queued_identifiers =
+      g_slist_prepend(bs->queued_identifiers, strdup(ea.name));
   }
   if (bs->queued_identifiers && GTK_IS_IMAGE(bs->stack->data)) {
     GSList *ii;
@@ -995,213 +1424,49 @@ void sax_start_element (BrowserBox *bb,
           g_signal_connect (bs->stack->data, "size-allocate",
                             G_CALLBACK(anchor_allocated), bs);
       }
-      g_hash_table_insert(bs->identifiers, ii->data, bs->stack->data);
+      Anchor *anchor = malloc(sizeof(Anchor));
+      anchor->widget = bs->stack->data;
+      anchor->child = -1;
+      g_hash_table_insert(bs->identifiers, ii->data, anchor);
     }
     g_slist_free_full(bs->queued_identifiers, g_free);
     bs->queued_identifiers = NULL;
   }
-
-  /* Forms */
-  if (strcmp(name, "form") == 0) {
-    Form *form = malloc(sizeof(Form));
-    form->submission_data = (gpointer)bb;
-    form->method = NULL;
-    form->enctype = ENCTYPE_URLENCODED;
-    form->action = NULL;
-    form->fields = NULL;
-    guint i;
-    gchar *action = NULL;
-    if (attrs != NULL) {
-      for (i = 0; attrs[i]; i += 2) {
-        if (strcmp((const char*)attrs[i], "method") == 0) {
-          form->method = strdup((const char*)attrs[i+1]);
-        }
-        if (strcmp((const char*)attrs[i], "enctype") == 0) {
-          if (strcmp((const char*)attrs[i + 1], "multipart/form-data") == 0) {
-            form->enctype = ENCTYPE_MULTIPART;
-          } else if (strcmp((const char*)attrs[i + 1], "text/plain") == 0) {
-            form->enctype = ENCTYPE_PLAIN;
-          }
-        }
-        if (strcmp((const char*)attrs[i], "action") == 0) {
-          action = strdup((const char*)attrs[i+1]);
-        }
-      }
-    }
-    if (action == NULL) {
-      form->action = soup_uri_copy(bs->uri);
-    } else {
-      form->action = soup_uri_new_with_base(bs->uri, action);
-    }
-    bb->forms = g_list_prepend(bb->forms, form);
-    bs->current_form = form;
-  }
 }
 
 void sax_end_element (BrowserBox *bb, const xmlChar *u_name)
 {
   BuilderState *bs = bb->builder_state;
-  const char *name = (const char*)u_name;
+  const ElementInfo *info = element_info((const char*)u_name);
 
   if (IS_INLINE_BOX(bs->stack->data)) {
-    if (element_flushes_text(name)) {
+    if (info->flags & EP_FLUSHES_TEXT) {
       if (bs->current_word != NULL) {
-        add_word(bs, bs->current_word, &bs->current_attrs);
+        add_words(bs, bs->current_word, &bs->current_attrs);
         free(bs->current_word);
         bs->current_word = NULL;
       }
       bs->prev_space = TRUE;
     }
-    if (element_is_blocking(name)) {
-      GSList *next = bs->stack->next;
-      if (next != NULL) {
-        g_slist_free_1(bs->stack);
-        bs->stack = next;
-      }
+    if (info->flags & EP_BLOCKING) {
+      stack_pop(bs);
       bs->prev_space = TRUE;
     }
   }
 
-  if ((strcmp(name, "dl") == 0 || strcmp(name, "ul") == 0 ||
-       strcmp(name, "ol") == 0 || strcmp(name, "dd") == 0 ||
-       strcmp(name, "li") == 0 || strcmp(name, "select") == 0)) {
-    GSList *next = bs->stack->next;
-    if (next != NULL) {
-      g_slist_free_1(bs->stack);
-      bs->stack = next;
-    }
-    if (bs->ol_numbers != NULL &&
-        (strcmp(name, "ol") == 0 || strcmp(name, "ul") == 0)) {
-      GSList *next = bs->ol_numbers->next;
-      g_free(bs->ol_numbers->data);
-      g_slist_free_1(bs->ol_numbers);
-      bs->ol_numbers = next;
-    }
-  }
-  if (bs->stack && strcmp(name, "li") == 0) {
-    /* repeat */
-    GSList *next = bs->stack->next;
-    if (next != NULL) {
-      g_slist_free_1(bs->stack);
-      bs->stack = next;
-    }
+  if (info->end != NULL) {
+    info->end(bb, info->element, NULL);
   }
 
-  if (strcmp(name, "option") == 0 && bs->option_value != NULL) {
-    free(bs->option_value);
-    bs->option_value = NULL;
-  }
-
-  /* Tables */
-  if (IS_TABLE_BOX(bs->stack->data)) {
-    if (strcmp(name, "table") == 0) {
-      GSList *next = bs->stack->next;
-      if (next != NULL) {
-        g_slist_free_1(bs->stack);
-        bs->stack = next;
-      }
-    }
-  }
-  if (IS_TABLE_CELL(bs->stack->data)) {
-    if (strcmp(name, "td") == 0 || strcmp(name, "th") == 0) {
-      GSList *next = bs->stack->next;
-      if (next != NULL) {
-        g_slist_free_1(bs->stack);
-        bs->stack = next;
-      }
-    }
-  }
-
-  /* Preformatted texts */
-  if (strcmp(name, "pre") == 0) {
-    bs->pre = FALSE;
-    bs->current_attrs = attribute_end(bs->current_attrs, PANGO_ATTR_FAMILY, 0);
-  }
-
-  /* Ignored */
-  if (strcmp(name, "head") == 0 || strcmp(name, "script") == 0 ||
-      strcmp(name, "style") == 0) {
+  if (info->flags & EP_IGNORED) {
     bs->ignore_text = FALSE;
   }
-
-  /* Formatting */
-  if (strcmp(name, "b") == 0 || strcmp(name, "strong") == 0) {
-    bs->current_attrs =
-      attribute_end(bs->current_attrs,
-                    PANGO_ATTR_WEIGHT,
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-  } else if (strcmp(name, "i") == 0 || strcmp(name, "em") == 0) {
-    bs->current_attrs =
-      attribute_end(bs->current_attrs,
-                    PANGO_ATTR_STYLE,
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-  } else if (strcmp(name, "code") == 0) {
-    bs->current_attrs =
-      attribute_end(bs->current_attrs,
-                    PANGO_ATTR_FAMILY,
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-  } else if (strcmp(name, "sub") == 0) {
-    bs->current_attrs =
-      attribute_end(bs->current_attrs,
-                    PANGO_ATTR_RISE,
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-    bs->current_attrs =
-      attribute_end(bs->current_attrs,
-                    PANGO_ATTR_SCALE,
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-  } else if (strcmp(name, "sup") == 0) {
-    bs->current_attrs =
-      attribute_end(bs->current_attrs,
-                    PANGO_ATTR_RISE,
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-    bs->current_attrs =
-      attribute_end(bs->current_attrs,
-                    PANGO_ATTR_SCALE,
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-  } else if (strcmp(name, "h1") == 0 || strcmp(name, "h2") == 0 ||
-             strcmp(name, "h3") == 0 || strcmp(name, "h4") == 0 ||
-             strcmp(name, "h5") == 0 || strcmp(name, "h6") == 0) {
-    bs->current_attrs =
-      attribute_end(bs->current_attrs,
-                    PANGO_ATTR_SCALE,
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-    bs->current_attrs =
-      attribute_end(bs->current_attrs,
-                    PANGO_ATTR_WEIGHT,
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-  } else if (strcmp(name, "a") == 0) {
-    bs->current_attrs =
-      attribute_end(bs->current_attrs,
-                    PANGO_ATTR_FOREGROUND,
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-    bs->current_attrs =
-      attribute_end(bs->current_attrs,
-                    PANGO_ATTR_UNDERLINE,
-                    (bs->current_word == NULL ? 0 : strlen(bs->current_word)));
-    if (bs->current_link != NULL) {
-      bs->current_link->end = bs->text_position;
-      bs->current_link = NULL;
-    }
-  }
-
-  /* Forms */
-  if (strcmp(name, "form") == 0) {
-    bs->current_form = NULL;
-  }
 }
 
 
 
 
 
-void select_text_cb (void *ptr,
-                     gchar *str,
-                     BrowserBox *bb)
-{
-  printf("Selection: '%s'\n", str);
-}
-
-
 void follow_link_cb (void *ptr,
                      gchar *url,
                      gboolean new_tab,
@@ -1281,7 +1546,8 @@ void got_chunk(SoupMessage *msg,
                       GTK_WIDGET (bs->vbox));
     g_signal_connect (bs->docbox, "follow", G_CALLBACK(follow_link_cb), bb);
     g_signal_connect (bs->docbox, "hover", G_CALLBACK(hover_link_cb), bb);
-    g_signal_connect (bs->docbox, "select", G_CALLBACK(select_text_cb), bb);
+    g_signal_connect (bs->docbox, "matches",
+                      G_CALLBACK(search_matches_cb), bb);
     gtk_widget_show_all(GTK_WIDGET(bs->docbox));
     gtk_box_set_child_packing(GTK_BOX(bs->root), GTK_WIDGET(bs->docbox),
                               TRUE, TRUE, 0, GTK_PACK_END);
@@ -1411,6 +1677,10 @@ browser_box_init (BrowserBox *bb)
   bb->history = NULL;
   bb->history_position = NULL;
   bb->search_string[0] = 0;
+  bb->search_matches = -1;
+  bb->search_matches_done = FALSE;
+  bb->search_regex = FALSE;
+  bb->search_invalid = FALSE;
   return;
 }
 
@@ -34,6 +34,15 @@ struct _FormField
   GtkWidget *widget;
 };
 
+/* An identified element: either a widget (child is -1), or a child
+   of an InlineBox. */
+typedef struct _Anchor Anchor;
+struct _Anchor
+{
+  GtkWidget *widget;
+  gint child;
+};
+
 enum {
   ENCTYPE_URLENCODED,
   ENCTYPE_MULTIPART,
@@ -69,6 +78,7 @@ struct _BuilderState
   gboolean ignore_text;
   gboolean prev_space;
   gboolean pre;
+  gboolean pre_start;
   htmlParserCtxtPtr parser;
   SoupURI *uri;
   GSList *queued_identifiers;
@@ -111,6 +121,14 @@ struct _BrowserBox
   GList *history_position;
   BTSState search_state;
   gchar search_string[MAX_SEARCH_STRING_LEN + 1];
+  /* The number of matches found so far (-1 if unknown), and whether
+     all of them are found. */
+  gint search_matches;
+  gboolean search_matches_done;
+  /* Whether the search string is a regular expression, and whether
+     it failed to compile. */
+  gboolean search_regex;
+  gboolean search_invalid;
   GtkStack *tabs;
   /* GHashTable *word_cache; */
 };
@@ -22,21 +22,45 @@
 G_DEFINE_TYPE (DocumentBox, document_box, GTK_TYPE_SCROLLED_WINDOW);
 
 
+static void hit_index_clear (HitIndex *hits);
+static void find_all_cancel (DocumentBox *db);
+static gboolean find_all_step (gpointer data);
+
 static void document_box_dispose (GObject *object) {
   DocumentBox *db = DOCUMENT_BOX(object);
-  if (db->links != NULL) {
-    /* The same links are also referenced from InlineBox, and freed on
-       its disposal, so only the list needs to be freed here. */
-    g_list_free(db->links);
-    db->links = NULL;
+  if (db->motion_tick_id != 0) {
+    gtk_widget_remove_tick_callback(GTK_WIDGET(db->evbox),
+                                    db->motion_tick_id);
+    db->motion_tick_id = 0;
   }
+  find_all_cancel(db);
+  hit_index_clear(&db->hits);
   G_OBJECT_CLASS (document_box_parent_class)->dispose (object);
 }
 
+static void document_box_finalize (GObject *object) {
+  DocumentBox *db = DOCUMENT_BOX(object);
+  /* InlineBoxes use it until they are destroyed along with the
+     document box. */
+  ib_focus_chain_free(db->focus_chain);
+  g_free(db->hits.entries);
+  g_free(db->hits.boxes);
+  g_free(db->hits.offsets);
+  g_free(db->hits.rows);
+  g_free(db->hits.row_entries);
+  g_free(db->search.str);
+  if (db->search.regex != NULL) {
+    g_regex_unref(db->search.regex);
+  }
+  g_free(db->search.pattern);
+  g_free(db->search.text);
+  G_OBJECT_CLASS (document_box_parent_class)->finalize (object);
+}
+
 enum {
   FOLLOW,
-  SELECT,
-  HOVER
+  HOVER,
+  MATCHES
 };
 
 static guint signals[3];
@@ -64,8 +88,8 @@ document_box_class_init (DocumentBoxClass *klass)
                  2,             /* n_params */
                  G_TYPE_STRING,
                  G_TYPE_BOOLEAN);
-  signals[SELECT] =
-    g_signal_new("select",
+  signals[HOVER] =
+    g_signal_new("hover",
                  G_TYPE_FROM_CLASS (gobject_class),
                  G_SIGNAL_RUN_LAST,
                  0,             /* class_offset */
@@ -75,8 +99,10 @@ document_box_class_init (DocumentBoxClass *klass)
                  G_TYPE_NONE,   /* return_type */
                  1,             /* n_params */
                  G_TYPE_STRING);
-  signals[HOVER] =
-    g_signal_new("hover",
+  /* The number of matches found so far, and whether the search is
+     complete. */
+  signals[MATCHES] =
+    g_signal_new("matches",
                  G_TYPE_FROM_CLASS (gobject_class),
                  G_SIGNAL_RUN_LAST,
                  0,             /* class_offset */
@@ -84,23 +110,54 @@ document_box_class_init (DocumentBoxClass *klass)
                  NULL,          /* accu_data */
                  NULL,          /* c_marshaller */
                  G_TYPE_NONE,   /* return_type */
-                 1,             /* n_params */
-                 G_TYPE_STRING);
+                 2,             /* n_params */
+                 G_TYPE_UINT,
+                 G_TYPE_BOOLEAN);
   widget_class->get_request_mode = document_box_get_request_mode;
   gobject_class->dispose = document_box_dispose;
+  gobject_class->finalize = document_box_finalize;
   return;
 }
 
 static void
 document_box_init (DocumentBox *db)
 {
-  db->links = NULL;
+  db->focus_chain = ib_focus_chain_new();
+  db->hits.entries = NULL;
+  db->hits.boxes = NULL;
+  db->hits.offsets = NULL;
+  db->hits.count = 0;
+  db->hits.size = 0;
+  db->hits.rows = NULL;
+  db->hits.rows_count = 0;
+  db->hits.rows_y0 = 0;
+  db->hits.row_entries = NULL;
+  db->hits.row_entries_size = 0;
+  db->hits.valid = FALSE;
+  db->origin_window = NULL;
+  db->motion_tick_id = 0;
+  db->hover_ib = NULL;
+  db->hover_link = NULL;
   db->search.ib = NULL;
   db->search.start = 0;
-  db->search.end = -1;
+  db->search.end = 0;
   db->search.str = NULL;
-  db->search.forward = TRUE;
-  db->search.state = START;
+  db->search.use_regex = FALSE;
+  db->search.regex = NULL;
+  db->search.pattern = NULL;
+  db->search.text = NULL;
+  db->search.text_length = 0;
+  db->find_all.source_id = 0;
+  db->find_all.active = FALSE;
+  db->find_all.next_box = 0;
+  db->find_all.count = 0;
+  db->find_all.rescan = FALSE;
+  db->find_all.ib = NULL;
+  db->find_all.offset = 0;
+  db->find_all.matches = NULL;
+  db->find_all.matches_count = 0;
+  db->find_all.matches_size = 0;
+  db->find_all.found = 0;
 }
 
 
@@ -109,218 +166,466 @@ struct _SearchState
 {
   gint x;
   gint y;
-  guint index;
   IBText *ibt;
   InlineBox *ib;
   guint ib_index;
 };
 
+/* Entries hold references, so that the boxes stay valid till the
+   index is rebuilt. */
 static void
-text_at_position(GtkWidget *widget, SearchState *st)
+hit_index_clear (HitIndex *hits)
 {
-  GtkAllocation alloc;
-  gtk_widget_get_allocation(widget, &alloc);
-  if (st->x >= alloc.x &&
-      st->x <= alloc.x + alloc.width &&
-      st->y >= alloc.y &&
-      st->y <= alloc.y + alloc.height) {
-    if (IS_INLINE_BOX(widget)) {
-      st->ib = INLINE_BOX(widget);
-      GList *ti;
-      guint text_position = 0;
-      for (ti = INLINE_BOX(widget)->children; ti; ti = ti->next) {
-        if (IS_IB_TEXT(ti->data)) {
-          IBText *ibt = IB_TEXT(ti->data);
-          if (st->x >= ibt->alloc.x &&
-              st->x <= ibt->alloc.x + ibt->alloc.width &&
-              st->y >= ibt->alloc.y &&
-              st->y <= ibt->alloc.y + ibt->alloc.height) {
-            gint position;
-            pango_layout_xy_to_index(ibt->layout,
-                                     (st->x - ibt->alloc.x) * PANGO_SCALE,
-                                     (st->y - ibt->alloc.y) * PANGO_SCALE,
-                                     &position,
-                                     NULL);
-            st->index = position;
-            st->ibt = ibt;
-            st->ib_index = text_position + position;
-            return;
-          }
-          text_position += strlen(pango_layout_get_text(ibt->layout));
-        }
-      }
-      return;
-    } else if (GTK_IS_CONTAINER(widget)) {
-      gtk_container_foreach(GTK_CONTAINER(widget),
-                            (GtkCallback)text_at_position, st);
+  guint i;
+  for (i = 0; i < hits->count; i++) {
+    g_object_unref(hits->entries[i].ib);
+  }
+  hits->count = 0;
+  hits->valid = FALSE;
+}
+
+/* Collects InlineBoxes in document order. Widgets inside of
+   InlineBoxes are not searched for texts. */
+static void
+hit_index_collect (GtkWidget *widget, HitIndex *hits)
+{
+  if (IS_INLINE_BOX(widget)) {
+    InlineBox *ib = INLINE_BOX(widget);
+    if (hits->count == hits->size) {
+      hits->size = hits->size > 0 ? hits->size * 2 : 64;
+      hits->entries = g_renew(HitEntry, hits->entries, hits->size);
+      hits->boxes = g_renew(InlineBox*, hits->boxes, hits->size);
+      hits->offsets = g_renew(guint, hits->offsets, hits->size + 1);
     }
+    HitEntry *entry = &hits->entries[hits->count];
+    entry->ib = g_object_ref(ib);
+    gtk_widget_get_allocation(widget, &entry->alloc);
+    hits->boxes[hits->count] = ib;
+    hits->offsets[hits->count + 1] =
+      hits->offsets[hits->count] + inline_box_get_text_length(ib);
+    ib->document_index = hits->count;
+    hits->count++;
+  } else if (GTK_IS_CONTAINER(widget)) {
+    gtk_container_foreach(GTK_CONTAINER(widget),
+                          (GtkCallback)hit_index_collect, hits);
   }
 }
 
-static gboolean widget_is_affected(GtkAllocation *wa, GtkAllocation *ta1,
-                                   GtkAllocation *ta2)
+static guint
+hit_row (HitIndex *hits, gint y)
 {
-  if (wa == NULL || ta1 == NULL || ta2 == NULL) {
-    return FALSE;
+  return (y - hits->rows_y0) / HIT_ROW_HEIGHT;
+}
+
+/* Lists the entries overlapping each row: counts them per row first,
+   then places them at their rows' offsets. */
+static void
+hit_index_build_rows (HitIndex *hits)
+{
+  guint i, row, total;
+  gint bottom = G_MININT;
+  hits->rows_count = 0;
+  if (hits->count == 0) {
+    return;
   }
-  return
-    gdk_rectangle_intersect(wa, ta1, NULL) ||
-    gdk_rectangle_intersect(wa, ta2, NULL) ||
-    ((ta2->y >= ta1->y &&
-      ((wa->y >= ta1->y) && (wa->y <= ta2->y))) ||
-     ((ta2->y <= ta1->y) &&
-      ((wa->y >= ta2->y) && (wa->y <= ta1->y))));
-}
-
-/* Assuming (Y, X) is strictly increasing */
-static gint compare_positions(GtkAllocation *a1, guint i1,
-                              GtkAllocation *a2, guint i2)
-{
-  if ((a1->y < a2->y) ||
-      (a1->y == a2->y && a1->x < a2->x) ||
-      (a1->y == a2->y && a1->x == a2->x && i1 < i2)) {
-    return -1;
-  } else if (a1->y == a2->y && a1->x == a2->x && i1 == i2) {
-    return 0;
-  } else {
-    return 1;
+  hits->rows_y0 = G_MAXINT;
+  for (i = 0; i < hits->count; i++) {
+    hits->rows_y0 = MIN(hits->rows_y0, hits->entries[i].alloc.y);
+    bottom = MAX(bottom, hits->entries[i].alloc.y +
+                 hits->entries[i].alloc.height);
+  }
+  hits->rows_count = hit_row(hits, bottom) + 1;
+  hits->rows = g_renew(guint, hits->rows, hits->rows_count + 1);
+  memset(hits->rows, 0, (hits->rows_count + 1) * sizeof(guint));
+  for (i = 0; i < hits->count; i++) {
+    GtkAllocation *alloc = &hits->entries[i].alloc;
+    for (row = hit_row(hits, alloc->y);
+         row <= hit_row(hits, alloc->y + alloc->height); row++) {
+      hits->rows[row + 1]++;
+    }
+  }
+  for (row = 0; row < hits->rows_count; row++) {
+    hits->rows[row + 1] += hits->rows[row];
+  }
+  total = hits->rows[hits->rows_count];
+  if (total > hits->row_entries_size) {
+    hits->row_entries_size = total;
+    hits->row_entries = g_renew(guint, hits->row_entries, total);
   }
+  /* Filling the rows advances their offsets to the next rows' ones,
+     so they are shifted back afterwards. */
+  for (i = 0; i < hits->count; i++) {
+    GtkAllocation *alloc = &hits->entries[i].alloc;
+    for (row = hit_row(hits, alloc->y);
+         row <= hit_row(hits, alloc->y + alloc->height); row++) {
+      hits->row_entries[hits->rows[row]++] = i;
+    }
+  }
+  for (row = hits->rows_count; row > 0; row--) {
+    hits->rows[row] = hits->rows[row - 1];
+  }
+  hits->rows[0] = 0;
+}
+
+static void
+hit_index_invalidate (GtkWidget *widget, GdkRectangle *alloc,
+                      DocumentBox *db)
+{
+  db->hits.valid = FALSE;
+  db->origin_window = NULL;
+  db->hover_ib = NULL;
+  /* Texts may have grown, including those of the boxes already
+     scanned */
+  if (db->find_all.active && db->find_all.source_id == 0) {
+    db->find_all.next_box = 0;
+    db->find_all.source_id = g_idle_add(find_all_step, db);
+  } else if (db->find_all.active) {
+    db->find_all.rescan = TRUE;
+  }
+}
+
+static gboolean
+hit_index_contains (HitIndex *hits, InlineBox *ib)
+{
+  return ib != NULL && ib->document_index < hits->count &&
+    hits->boxes[ib->document_index] == ib;
+}
+
+static guint
+document_offset (HitIndex *hits, InlineBox *ib, guint index)
+{
+  return hits->offsets[ib->document_index] + index;
+}
+
+/* Returns the index of the box containing a document offset. */
+static guint
+box_at_offset (HitIndex *hits, guint offset)
+{
+  guint low = 0, high = hits->count;
+  while (high - low > 1) {
+    guint mid = (low + high) / 2;
+    if (hits->offsets[mid] <= offset) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
 }
 
-/* Updates InlineBox widgets to render selection appropriately. */
 static void
-selection_update (GtkWidget *widget, SelectionState *st)
+hit_index_update (DocumentBox *db)
 {
-  if (st->selection_start == NULL ||
-      st->selection_end == NULL ||
-      st->selection_prev == NULL) {
+  if (db->hits.valid) {
     return;
   }
-  GtkAllocation alloc, alloc_start, alloc_end, alloc_prev;
-  gtk_widget_get_allocation(widget, &alloc);
-  gtk_widget_get_allocation(GTK_WIDGET(st->selection_start), &alloc_start);
-  gtk_widget_get_allocation(GTK_WIDGET(st->selection_end), &alloc_end);
-  gtk_widget_get_allocation(GTK_WIDGET(st->selection_prev), &alloc_prev);
-  if (widget_is_affected(&alloc, &alloc_start, &alloc_end) ||
-      widget_is_affected(&alloc, &alloc_start, &alloc_prev) ||
-      widget_is_affected(&alloc, &alloc_end, &alloc_prev)) {
-    if (IS_INLINE_BOX(widget)) {
-      InlineBox *ib = INLINE_BOX(widget);
-      ib->selection_end = 0;
-      ib->selection_start = 0;
-      gint direction = compare_positions(&alloc_start,
-                                         st->selection_start_index,
-                                         &alloc_end,
-                                         st->selection_end_index);
-      if (direction == -1) {
-        if (st->selection_start == ib) {
-          ib->selection_start = st->selection_start_index;
-          st->selecting = TRUE;
-        }
-        if (st->selecting && st->selection_end == ib) {
-          ib->selection_end = st->selection_end_index;
-          st->selecting = FALSE;
-        }
-      } else if (direction == 1) {
-        if (st->selection_end == ib) {
-          ib->selection_start = st->selection_end_index;
-          st->selecting = TRUE;
-        }
-        if (st->selecting && st->selection_start == ib) {
-          ib->selection_end = st->selection_start_index;
-          st->selecting = FALSE;
-        }
-      }
+  hit_index_clear(&db->hits);
+  if (db->hits.offsets == NULL) {
+    db->hits.offsets = g_new(guint, 1);
+  }
+  db->hits.offsets[0] = 0;
+  hit_index_collect(GTK_WIDGET(db->evbox), &db->hits);
+  hit_index_build_rows(&db->hits);
+  db->hits.valid = TRUE;
+  g_free(db->search.text);
+  db->search.text = NULL;
 
-      if (st->selecting) {
-        ib->selection_end = inline_box_get_text_length(ib);
-      }
+  /* Document offsets may shift, while the selected boxes stay the
+     same. */
+  if (db->sel.start < db->sel.end) {
+    if (hit_index_contains(&db->hits, db->sel.selection_start) &&
+        hit_index_contains(&db->hits, db->sel.selection_end)) {
+      guint start = document_offset(&db->hits, db->sel.selection_start,
+                                    db->sel.selection_start_index);
+      guint end = document_offset(&db->hits, db->sel.selection_end,
+                                  db->sel.selection_end_index);
+      db->sel.start = MIN(start, end);
+      db->sel.end = MAX(start, end);
+    } else {
+      db->sel.start = 0;
+      db->sel.end = 0;
+      db->sel.selection_start = NULL;
+      db->sel.selection_end = NULL;
+    }
+  }
+}
 
-      gtk_widget_queue_draw (widget);
-    } else if (GTK_IS_CONTAINER(widget)) {
-      gtk_container_foreach(GTK_CONTAINER(widget),
-                            (GtkCallback)selection_update, st);
+/* Finds the InlineBox at a point, and a text in it, if any. Only the
+   boxes overlapping the point's row are checked, so it takes time
+   proportional to their number. Boxes may overlap (e.g., in table
+   cells); the first one in document order wins. */
+static void
+text_at_position(DocumentBox *db, SearchState *st)
+{
+  HitIndex *hits = &db->hits;
+  st->ib = NULL;
+  st->ibt = NULL;
+  hit_index_update(db);
+  if (hits->rows_count == 0 || st->y < hits->rows_y0 ||
+      hit_row(hits, st->y) >= hits->rows_count) {
+    return;
+  }
+  guint row = hit_row(hits, st->y), i;
+  HitEntry *found = NULL;
+  for (i = hits->rows[row]; i < hits->rows[row + 1] && found == NULL; i++) {
+    HitEntry *entry = &hits->entries[hits->row_entries[i]];
+    if (st->x >= entry->alloc.x &&
+        st->x <= entry->alloc.x + entry->alloc.width &&
+        st->y >= entry->alloc.y &&
+        st->y <= entry->alloc.y + entry->alloc.height) {
+      found = entry;
+    }
+  }
+  if (found != NULL) {
+    st->ib = found->ib;
+    guint position;
+    IBText *ibt = inline_box_text_at_point(st->ib, st->x, st->y, &position);
+    if (ibt != NULL) {
+      st->ibt = ibt;
+      st->ib_index = position;
     }
   }
 }
 
+/* Updates the selection of boxes between given document offsets,
+   for a new selection range. */
 static void
-selection_read (GtkWidget *widget, gchar **str)
+selection_apply_span (DocumentBox *db, guint from, guint to,
+                      guint start, guint end)
 {
-  if (IS_INLINE_BOX(widget)) {
-    InlineBox *ib = INLINE_BOX(widget);
-    if (ib->selection_end == 0) {
-      return;
+  HitIndex *hits = &db->hits;
+  guint i, last = box_at_offset(hits, to);
+  for (i = box_at_offset(hits, from); i <= last && i < hits->count; i++) {
+    guint box_start = hits->offsets[i], box_end = hits->offsets[i + 1];
+    if (start < end && start < box_end && end > box_start) {
+      inline_box_set_selection(hits->boxes[i],
+                               start > box_start ? start - box_start : 0,
+                               MIN(end, box_end) - box_start);
+    } else {
+      inline_box_set_selection(hits->boxes[i], 0, 0);
+    }
+  }
+}
+
+/* Sets the selected document range, only updating the boxes around
+   the changed ends of the range. */
+static void
+selection_apply (DocumentBox *db, guint start, guint end)
+{
+  SelectionState *sel = &db->sel;
+  if (db->hits.count == 0 || (start == sel->start && end == sel->end)) {
+    return;
+  }
+  if (sel->start >= sel->end || start >= end ||
+      sel->end < start || end < sel->start) {
+    if (sel->start < sel->end) {
+      selection_apply_span(db, sel->start, sel->end, start, end);
+    }
+    if (start < end) {
+      selection_apply_span(db, start, end, start, end);
     }
-    GList *ti;
-    guint text_position = 0;
+  } else {
+    selection_apply_span(db, MIN(sel->start, start), MAX(sel->start, start),
+                         start, end);
+    selection_apply_span(db, MIN(sel->end, end), MAX(sel->end, end),
+                         start, end);
+  }
+  sel->start = start;
+  sel->end = end;
+}
+
+/* Applies the selection between its start and end positions. */
+static void
+selection_update (DocumentBox *db)
+{
+  SelectionState *sel = &db->sel;
+  hit_index_update(db);
+  if (! (hit_index_contains(&db->hits, sel->selection_start) &&
+         hit_index_contains(&db->hits, sel->selection_end))) {
+    selection_apply(db, 0, 0);
+    return;
+  }
+  guint start = document_offset(&db->hits, sel->selection_start,
+                                sel->selection_start_index);
+  guint end = document_offset(&db->hits, sel->selection_end,
+                              sel->selection_end_index);
+  selection_apply(db, MIN(start, end), MAX(start, end));
+}
+
+static void
+selection_clear (DocumentBox *db)
+{
+  hit_index_update(db);
+  selection_apply(db, 0, 0);
+  db->sel.selection_start = NULL;
+  db->sel.selection_end = NULL;
+}
+
+/* Returns the text of a document range, with newlines in place of
+   line breaks and between boxes. */
+static gchar *
+selection_read (DocumentBox *db, guint range_start, guint range_end)
+{
+  HitIndex *hits = &db->hits;
+  GString *str = g_string_new(NULL);
+  guint b, i;
+  hit_index_update(db);
+  if (range_start >= range_end) {
+    return g_string_free(str, FALSE);
+  }
+  for (b = box_at_offset(hits, range_start);
+       b < hits->count && hits->offsets[b] < range_end; b++) {
+    InlineBox *ib = hits->boxes[b];
+    const gchar *text = inline_box_get_text(ib);
+    guint start = range_start > hits->offsets[b]
+      ? range_start - hits->offsets[b] : 0;
+    guint end = MIN(range_end, hits->offsets[b + 1]) - hits->offsets[b];
     gboolean affected = FALSE, breaks = FALSE;
-    for (ti = ib->children; ti; ti = ti->next) {
-      if (IS_IB_TEXT(ti->data)) {
-        IBText *ibt = IB_TEXT(ti->data);
-        const gchar *word = pango_layout_get_text(ibt->layout);
-        guint word_len = strlen(word);
-        if (ib->selection_start <= text_position + word_len &&
-            ib->selection_end > text_position) {
-          guint start_offset = 0, end_offset = 0;
-          if (ib->selection_start > text_position) {
-            start_offset = ib->selection_start - text_position;
-          }
-          if (ib->selection_end < text_position + word_len) {
-            end_offset = text_position + word_len - ib->selection_end;
-          }
-          guint len = word_len - start_offset - end_offset;
-          *str = realloc(*str, strlen(*str) + len + 1);
-          g_strlcpy(*str + strlen(*str), word + start_offset, len + 1);
+    if (start >= end) {
+      continue;
+    }
+    for (i = inline_box_find_offset(ib, start);
+         i < ib->children_count && ib->offset[i] < end; i++) {
+      if (ib->kind[i] == IB_CHILD_TEXT) {
+        guint from = MAX(start, ib->offset[i]);
+        guint to = MIN(end, ib->offset[i] + inline_box_child_length(ib, i));
+        if (from < to) {
+          g_string_append_len(str, text + from, to - from);
           affected = TRUE;
           breaks = TRUE;
-        } else {
-          breaks = FALSE;
         }
-        text_position += word_len;
-      } else if (breaks && IS_IB_BREAK(ti->data)) {
-        *str = realloc(*str, strlen(*str) + 2);
-        (*str)[strlen(*str) + 1] = 0;
-        (*str)[strlen(*str)] = '\n';
+      } else if (breaks && ib->kind[i] == IB_CHILD_BREAK) {
+        g_string_append_c(str, '\n');
         breaks = FALSE;
       }
     }
     if (affected) {
       /* Add one more newline in the end, so that there are newlines
          between paragraphs. */
-      *str = realloc(*str, strlen(*str) + 2);
-      (*str)[strlen(*str) + 1] = 0;
-      (*str)[strlen(*str)] = '\n';
+      g_string_append_c(str, '\n');
     }
-  } else if (GTK_IS_CONTAINER(widget)) {
-    gtk_container_foreach(GTK_CONTAINER(widget),
-                          (GtkCallback)selection_read, str);
   }
+  if (str->len > 0) {
+    /* Strip the last newline */
+    g_string_truncate(str, str->len - 1);
+  }
+  return g_string_free(str, FALSE);
 }
 
-static IBLink *find_link (SearchState *ss, gint x, gint y)
+static SelectionRange *
+clipboard_range (GtkClipboard *clipboard, DocumentBox *db)
 {
-  if (ss->ib && ss->ib->links != NULL) {
-    GList *li;
-    for (li = ss->ib->links; li; li = li->next) {
-      IBLink *link = IB_LINK(li->data);
-      if (ss->ibt) {
-        if (link->start <= ss->ib_index && link->end > ss->ib_index) {
-          return link;
-        }
-      }
-      GList *oi;
-      GtkAllocation alloc;
-      for (oi = link->objects; oi; oi = oi->next) {
-        gtk_widget_get_allocation(oi->data, &alloc);
-        if (alloc.x <= x && alloc.x + alloc.width >= x &&
-            alloc.y <= y && alloc.y + alloc.height >= y) {
-          return link;
-        }
-      }
+  if (gtk_clipboard_get_selection(clipboard) == GDK_SELECTION_PRIMARY) {
+    return &db->primary;
+  }
+  return &db->clipboard;
+}
+
+/* Reads a published range at the current document offsets; it is
+   empty if its boxes are gone. */
+static void
+clipboard_get (GtkClipboard *clipboard, GtkSelectionData *data,
+               guint info, DocumentBox *db)
+{
+  SelectionRange *range = clipboard_range(clipboard, db);
+  guint start = 0, end = 0;
+  gchar *str;
+  hit_index_update(db);
+  if (hit_index_contains(&db->hits, range->start) &&
+      hit_index_contains(&db->hits, range->end)) {
+    start = document_offset(&db->hits, range->start, range->start_index);
+    end = document_offset(&db->hits, range->end, range->end_index);
+  }
+  str = selection_read(db, MIN(start, end), MAX(start, end));
+  gtk_selection_data_set_text(data, str, -1);
+  g_free(str);
+}
+
+static void
+clipboard_clear (GtkClipboard *clipboard, DocumentBox *db)
+{
+  SelectionRange *range = clipboard_range(clipboard, db);
+  range->start = NULL;
+  range->end = NULL;
+}
+
+/* Takes ownership of a selection (PRIMARY or CLIPBOARD) for the
+   current selection range, without reading its text: that is done
+   in clipboard_get, only if and when it's requested. Large texts are
+   transferred incrementally by GTK. */
+static void
+selection_publish (DocumentBox *db, GdkAtom selection)
+{
+  if (db->sel.start >= db->sel.end) {
+    return;
+  }
+  GtkTargetList *list = gtk_target_list_new(NULL, 0);
+  gtk_target_list_add_text_targets(list, 0);
+  gint targets_count;
+  GtkTargetEntry *targets = gtk_target_table_new_from_list(list,
+                                                           &targets_count);
+  gtk_clipboard_set_with_owner(gtk_widget_get_clipboard(GTK_WIDGET(db),
+                                                        selection),
+                               targets, targets_count,
+                               (GtkClipboardGetFunc)clipboard_get,
+                               (GtkClipboardClearFunc)clipboard_clear,
+                               G_OBJECT(db));
+  gtk_target_table_free(targets, targets_count);
+  gtk_target_list_unref(list);
+  /* Set after taking ownership, since that may clear the range
+     published previously. */
+  SelectionRange *range = (selection == GDK_SELECTION_PRIMARY) ?
+    &db->primary : &db->clipboard;
+  range->start = db->sel.selection_start;
+  range->start_index = db->sel.selection_start_index;
+  range->end = db->sel.selection_end;
+  range->end_index = db->sel.selection_end_index;
+}
+
+/* Finds the link at a position: either the one containing the text
+   at it, or the one containing a widget there. */
+static IBLink *find_link (SearchState *ss)
+{
+  if (ss->ib == NULL) {
+    return NULL;
+  }
+  if (ss->ibt) {
+    return inline_box_link_at_offset(ss->ib, ss->ib_index);
+  }
+  return inline_box_widget_link_at_point(ss->ib, ss->x, ss->y);
+}
+
+/* Translates event coordinates into those of the event box's parent
+   window. Window positions are known on the client side, so unlike
+   gdk_window_get_origin, this doesn't need server round trips. */
+static void
+event_position (DocumentBox *db, GdkWindow *window, gdouble x, gdouble y,
+                gint *doc_x, gint *doc_y)
+{
+  if (window != db->origin_window) {
+    GdkWindow *parent =
+      gtk_widget_get_parent_window(GTK_WIDGET(db->evbox));
+    GdkWindow *w;
+    gint wx, wy;
+    db->origin_x = 0;
+    db->origin_y = 0;
+    for (w = window; w != NULL && w != parent; w = gdk_window_get_parent(w)) {
+      gdk_window_get_position(w, &wx, &wy);
+      db->origin_x += wx;
+      db->origin_y += wy;
+    }
+    if (w == NULL) {
+      /* Not a descendant, falling back to screen coordinates */
+      gint orig_x, orig_y, ev_orig_x, ev_orig_y;
+      gdk_window_get_origin(parent, &orig_x, &orig_y);
+      gdk_window_get_origin(window, &ev_orig_x, &ev_orig_y);
+      db->origin_x = ev_orig_x - orig_x;
+      db->origin_y = ev_orig_y - orig_y;
     }
+    db->origin_window = window;
   }
-  return NULL;
+  *doc_x = db->origin_x + x;
+  *doc_y = db->origin_y + y;
 }
 
 static gboolean
@@ -332,23 +637,10 @@ button_press_event_cb (GtkWidget      *widget,
     return FALSE;
   }
   SearchState ss;
-  gint orig_x, orig_y, ev_orig_x, ev_orig_y;
-  gdk_window_get_origin(gtk_widget_get_parent_window(GTK_WIDGET(db->evbox)),
-                        &orig_x, &orig_y);
-  gdk_window_get_origin(event->window, &ev_orig_x, &ev_orig_y);
-  ss.ibt = NULL;
-  ss.x = ev_orig_x - orig_x + event->x;
-  ss.y = ev_orig_y - orig_y + event->y;
-  text_at_position(widget, &ss);
-
-  if (db->sel.selection_end) {
-    /* Remove existing selection */
-    db->sel.selection_prev = db->sel.selection_end;
-    db->sel.selection_prev_index = db->sel.selection_end_index + 1;
-    db->sel.selection_end = db->sel.selection_start;
-    db->sel.selection_end_index = db->sel.selection_start_index;
-    selection_update(widget, &db->sel);
-  }
+  event_position(db, event->window, event->x, event->y, &ss.x, &ss.y);
+  text_at_position(db, &ss);
+
+  selection_clear(db);
 
   if (ss.ib) {
     db->sel.selection_active = TRUE;
@@ -356,6 +648,7 @@ button_press_event_cb (GtkWidget      *widget,
     db->sel.selection_start_index = ss.ib_index;
     db->sel.selection_end = ss.ib;
     db->sel.selection_end_index = ss.ib_index;
+    selection_update(db);
     /* todo: grab focus when any non-widget space is clicked, not
        just texts */
     gtk_widget_grab_focus(GTK_WIDGET(db));
@@ -364,32 +657,65 @@ button_press_event_cb (GtkWidget      *widget,
 }
 
 static gboolean
-motion_notify_event_cb (GtkWidget      *widget,
-                        GdkEventButton *event,
-                        DocumentBox    *db)
+point_in_rectangle (GdkRectangle *rect, gint x, gint y)
+{
+  return x >= rect->x && x < rect->x + rect->width &&
+    y >= rect->y && y < rect->y + rect->height;
+}
+
+static gboolean
+motion_tick_cb (GtkWidget *widget, GdkFrameClock *frame_clock,
+                DocumentBox *db)
 {
+  db->motion_tick_id = 0;
+  if (db->hover_ib != NULL && (! db->sel.selection_active) &&
+      point_in_rectangle(&db->hover_rect, db->motion_x, db->motion_y)) {
+    return G_SOURCE_REMOVE;
+  }
   SearchState ss;
-  gint orig_x, orig_y, ev_orig_x, ev_orig_y;
-  gdk_window_get_origin(gtk_widget_get_parent_window(GTK_WIDGET(db->evbox)),
-                        &orig_x, &orig_y);
-  gdk_window_get_origin(event->window, &ev_orig_x, &ev_orig_y);
-  ss.ib = NULL;
-  ss.ibt = NULL;
-  ss.x = ev_orig_x - orig_x + event->x;
-  ss.y = ev_orig_y - orig_y + event->y;
-  text_at_position(widget, &ss);
+  ss.x = db->motion_x;
+  ss.y = db->motion_y;
+  text_at_position(db, &ss);
   if (ss.ib && db->sel.selection_active) {
-    db->sel.selection_prev = db->sel.selection_end;
-    db->sel.selection_prev_index = db->sel.selection_end_index;
     db->sel.selection_end = ss.ib;
     db->sel.selection_end_index = ss.ib_index;
-    db->sel.selecting = FALSE;
-    selection_update(widget, &db->sel);
+    selection_update(db);
   }
-  IBLink *link = find_link(&ss, event->x, event->y);
-  if (link != NULL) {
+
+  /* Remembering the word under the pointer; the position may be at
+     the end of a word, which is also the start of the next one. */
+  db->hover_ib = NULL;
+  if (ss.ibt != NULL) {
+    guint child = inline_box_find_offset(ss.ib, ss.ib_index);
+    inline_box_get_child_allocation(ss.ib, child, &db->hover_rect);
+    if ((! point_in_rectangle(&db->hover_rect, ss.x, ss.y)) && child > 0) {
+      inline_box_get_child_allocation(ss.ib, child - 1, &db->hover_rect);
+    }
+    if (point_in_rectangle(&db->hover_rect, ss.x, ss.y)) {
+      db->hover_ib = ss.ib;
+    }
+  }
+
+  IBLink *link = find_link(&ss);
+  if (link != NULL && link != db->hover_link) {
     g_signal_emit(db, signals[HOVER], 0, link->url);
   }
+  db->hover_link = link;
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+motion_notify_event_cb (GtkWidget      *widget,
+                        GdkEventMotion *event,
+                        DocumentBox    *db)
+{
+  event_position(db, event->window, event->x, event->y,
+                 &db->motion_x, &db->motion_y);
+  if (db->motion_tick_id == 0) {
+    db->motion_tick_id =
+      gtk_widget_add_tick_callback(widget, (GtkTickCallback)motion_tick_cb,
+                                   db, NULL);
+  }
   return FALSE;
 }
 
@@ -402,34 +728,22 @@ button_release_event_cb (GtkWidget      *widget,
   if (event->button != 1 && event->button != 2) {
     return FALSE;
   }
-  gchar *str = malloc(1);
-  gboolean got_selection = FALSE;
-  str[0] = 0;
-  selection_read(widget, &str);
-  if (strlen(str) > 0) {
-    /* Strip the last newline */
-    str[strlen(str) - 1] = 0;
-    got_selection = TRUE;
+  if (db->motion_tick_id != 0) {
+    /* Catching up with the pointer */
+    gtk_widget_remove_tick_callback(widget, db->motion_tick_id);
+    motion_tick_cb(widget, NULL, db);
   }
-  g_signal_emit(db, signals[SELECT], 0, str);
-  g_free(str);
   db->sel.selection_active = FALSE;
-  if (got_selection) {
+  if (db->sel.start < db->sel.end) {
+    selection_publish(db, GDK_SELECTION_PRIMARY);
     return FALSE;
   }
 
   SearchState ss;
-  gint orig_x, orig_y, ev_orig_x, ev_orig_y;
-  gdk_window_get_origin(gtk_widget_get_parent_window(GTK_WIDGET(db->evbox)),
-                        &orig_x, &orig_y);
-  gdk_window_get_origin(event->window, &ev_orig_x, &ev_orig_y);
-  ss.ib = NULL;
-  ss.ibt = NULL;
-  ss.x = ev_orig_x - orig_x + event->x;
-  ss.y = ev_orig_y - orig_y + event->y;
-  text_at_position(widget, &ss);
-
-  IBLink *link = find_link(&ss, event->x, event->y);
+  event_position(db, event->window, event->x, event->y, &ss.x, &ss.y);
+  text_at_position(db, &ss);
+
+  IBLink *link = find_link(&ss);
   if (link != NULL) {
     g_signal_emit(db, signals[FOLLOW], 0, link->url, event->button == 2);
     return TRUE;
@@ -437,34 +751,65 @@ button_release_event_cb (GtkWidget      *widget,
   return FALSE;
 }
 
+/* Scrolls to a text offset in a box, if it's not visible. */
 static void
-find_focused (GtkWidget *widget, GObject **focused) {
-  if (IS_INLINE_BOX(widget)) {
-    if (INLINE_BOX(widget)->focused_object != NULL) {
-      *focused = INLINE_BOX(widget)->focused_object;
-      return;
-    }
-  } else if (GTK_IS_CONTAINER(widget)) {
-    gtk_container_foreach(GTK_CONTAINER(widget),
-                          (GtkCallback)find_focused, focused);
-  }
+scroll_to_offset (DocumentBox *db, InlineBox *ib, guint offset)
+{
+  GtkAllocation alloc;
+  guint child = inline_box_find_offset(ib, offset);
+  inline_box_get_child_allocation(ib, child, &alloc);
+  GtkAdjustment *adj =
+    gtk_scrolled_window_get_vadjustment(GTK_SCROLLED_WINDOW(db));
+  gtk_adjustment_clamp_page(adj, alloc.y, alloc.y + alloc.height);
 }
 
+/* Scrolls to the focused object, if it's not visible. */
+static void
+scroll_to_focused (DocumentBox *db)
+{
+  IBFocusChain *chain = db->focus_chain;
+  gpointer object = g_ptr_array_index(chain->objects, chain->current);
+  GtkAllocation alloc;
+  if (IS_IB_LINK(object)) {
+    scroll_to_offset(db, g_ptr_array_index(chain->boxes, chain->current),
+                     IB_LINK(object)->start);
+    return;
+  }
+  gtk_widget_get_allocation(object, &alloc);
+  GtkAdjustment *adj =
+    gtk_scrolled_window_get_vadjustment(GTK_SCROLLED_WINDOW(db));
+  gtk_adjustment_clamp_page(adj, alloc.y, alloc.y + alloc.height);
+}
 
 static gboolean
 key_press_event_cb (GtkWidget *widget, GdkEventKey *event, DocumentBox *db)
 {
-  if (event->keyval == GDK_KEY_Return) {
-    GObject *focused;
-    /* This is inefficient and can be optimised, but there's no
-       perceivable delay, so perhaps it doesn't worth adding more
-       code. */
-    find_focused(widget, &focused);
-    if (focused != NULL && IS_IB_LINK(focused)) {
-      g_signal_emit(db, signals[FOLLOW], 0, IB_LINK(focused)->url,
+  IBFocusChain *chain = db->focus_chain;
+  if (event->keyval == GDK_KEY_c && (event->state & GDK_CONTROL_MASK)) {
+    if (db->sel.start < db->sel.end) {
+      selection_publish(db, GDK_SELECTION_CLIPBOARD);
+      return TRUE;
+    }
+  } else if (event->keyval == GDK_KEY_Return) {
+    if (chain->current >= 0 &&
+        IS_IB_LINK(g_ptr_array_index(chain->objects, chain->current))) {
+      IBLink *link = g_ptr_array_index(chain->objects, chain->current);
+      g_signal_emit(db, signals[FOLLOW], 0, link->url,
                     event->state & GDK_CONTROL_MASK);
       return TRUE;
     }
+  } else if (event->keyval == GDK_KEY_Tab ||
+             event->keyval == GDK_KEY_ISO_Left_Tab) {
+    /* Moving along the focus chain directly; if it's over, GTK moves
+       focus out of the document. */
+    if (ib_focus_chain_move(chain,
+                            event->keyval == GDK_KEY_ISO_Left_Tab ||
+                            (event->state & GDK_SHIFT_MASK)
+                            ? GTK_DIR_TAB_BACKWARD
+                            : GTK_DIR_TAB_FORWARD)) {
+      scroll_to_focused(db);
+      return TRUE;
+    }
   }
   return FALSE;
 }
@@ -485,76 +830,424 @@ DocumentBox *document_box_new ()
                     G_CALLBACK (button_release_event_cb), db);
   g_signal_connect (db->evbox, "motion-notify-event",
                     G_CALLBACK (motion_notify_event_cb), db);
+  g_signal_connect (db->evbox, "size-allocate",
+                    G_CALLBACK (hit_index_invalidate), db);
   g_signal_connect (db->evbox, "key-press-event",
                     G_CALLBACK (key_press_event_cb), db);
-  db->links = NULL;
   db->sel.selection_active = FALSE;
+  db->sel.selection_start = NULL;
+  db->sel.selection_end = NULL;
+  db->sel.start = 0;
+  db->sel.end = 0;
+  db->primary.start = NULL;
+  db->primary.end = NULL;
+  db->clipboard.start = NULL;
+  db->clipboard.end = NULL;
   return db;
 }
 
+/* Searches for the current search string from a position in the
+   document's box index: in the forward direction, for a match at or
+   after the given offset in the given box; in the backward one, for
+   a match starting before it. Matches don't overlap, as when finding
+   all of them. Boxes are searched in their case-folded
+   texts, which are kept along with the boxes, and only folded as
+   they grow. */
+static gboolean
+document_box_search (DocumentBox *db, guint box, guint offset,
+                     gboolean forward)
+{
+  HitIndex *hits = &db->hits;
+  gint pos = -1;
+  guint b = box;
+  if (hits->count == 0 || db->search.str == NULL ||
+      db->search.str[0] == 0) {
+    return FALSE;
+  }
+  if (forward) {
+    for (b = box; b < hits->count && pos == -1; b++) {
+      pos = inline_box_search(hits->boxes[b], b == box ? offset : 0, -1,
+                              db->search.str);
+    }
+    b--;
+  } else {
+    for (b = box + 1; b > 0 && pos == -1; b--) {
+      pos = inline_box_search_backward(hits->boxes[b - 1],
+                                       b - 1 == box ? offset : G_MAXUINT,
+                                       db->search.str);
+    }
+  }
+  if (pos == -1) {
+    return FALSE;
+  }
+  db->search.ib = hits->boxes[b];
+  db->search.start = pos;
+  db->search.end = pos + strlen(db->search.str);
+  db->sel.selection_start = db->search.ib;
+  db->sel.selection_start_index = db->search.start;
+  db->sel.selection_end = db->search.ib;
+  db->sel.selection_end_index = db->search.end;
+  selection_update(db);
+  scroll_to_offset(db, db->search.ib, db->search.start);
+  return TRUE;
+}
+
+/* Searches from the document's beginning or end. */
+static gboolean
+document_box_search_all (DocumentBox *db, gboolean forward)
+{
+  if (db->hits.count == 0) {
+    return FALSE;
+  }
+  return forward
+    ? document_box_search(db, 0, 0, TRUE)
+    : document_box_search(db, db->hits.count - 1, G_MAXUINT, FALSE);
+}
+
+/* Time to spend on finding matches per idle callback, in
+   microseconds. */
+#define FIND_ALL_SLICE 5000
+/* Bytes to search for matches at once, between the time checks. */
+#define FIND_ALL_CHUNK 65536
+
+/* Forgets the box being scanned, along with the matches found in it
+   so far. */
 static void
-document_box_search (GtkWidget *widget, DocumentBox *db) {
-  /* todo: backwards search */
-  if (db->search.state == FOUND) {
-    return;
+find_all_drop_box (FindAllState *fa)
+{
+  if (fa->ib != NULL) {
+    g_object_unref(fa->ib);
+    fa->ib = NULL;
   }
-  if (db->search.state == START &&
-      (db->search.ib == NULL || GTK_WIDGET(db->search.ib) == widget)) {
-    /* No previous position or found the widget */
-    db->search.state = LOOKING;
-    if (db->search.ib != NULL) {
-      db->sel.selection_prev = db->search.ib;
+  g_free(fa->matches);
+  fa->matches = NULL;
+  fa->matches_count = 0;
+  fa->matches_size = 0;
+  fa->found = 0;
+}
+
+/* Stops finding matches, and clears the ones found so far. */
+static void
+find_all_cancel (DocumentBox *db)
+{
+  guint i;
+  if (db->find_all.source_id != 0) {
+    g_source_remove(db->find_all.source_id);
+    db->find_all.source_id = 0;
+  }
+  find_all_drop_box(&db->find_all);
+  for (i = 0; i < db->hits.count; i++) {
+    if (db->hits.boxes[i]->matches_count > 0) {
+      inline_box_set_matches(db->hits.boxes[i], NULL, 0, 0);
     }
+    db->hits.boxes[i]->matches_scanned = 0;
   }
-  if (db->search.state == LOOKING &&
-      (db->search.ib == NULL || GTK_WIDGET(db->search.ib) != widget)) {
-    db->search.start = 0;
-    db->search.end = -1;
+  db->find_all.active = FALSE;
+  db->find_all.next_box = 0;
+  db->find_all.count = 0;
+  db->find_all.rescan = FALSE;
+}
+
+/* Starts scanning a box, from where it was left, if its text has
+   grown since then. Returns FALSE if there's nothing new to scan. */
+static gboolean
+find_all_start_box (FindAllState *fa, InlineBox *ib, guint len)
+{
+  if (ib->matches_scanned >= inline_box_get_text_length(ib)) {
+    return FALSE;
   }
-  if (db->search.state == LOOKING && IS_INLINE_BOX(widget)) {
-    InlineBox *ib = INLINE_BOX(widget);
-    gint pos = inline_box_search(ib, db->search.start, db->search.end, db->search.str);
-    if (pos != -1) {
-      db->search.state = FOUND;
-      db->search.ib = ib;
-      db->search.start = pos;
-      db->search.end = pos + strlen(db->search.str);
-
-      db->sel.selection_start = db->search.ib;
-      db->sel.selection_start_index = db->search.start;
-      db->sel.selection_end = db->search.ib;
-      db->sel.selection_end_index = db->search.end;
-      selection_update(widget, &db->sel);
-      gtk_widget_queue_draw(widget);
-    }
-  } else if (db->search.state != FOUND && GTK_IS_CONTAINER(widget)) {
-    gtk_container_foreach(GTK_CONTAINER(widget),
-                          (GtkCallback)document_box_search, db);
+  fa->ib = g_object_ref(ib);
+  /* The matches found before could only end within the text scanned
+     then, and the next one can't overlap the last of them. */
+  fa->offset = ib->matches_scanned >= len
+    ? ib->matches_scanned - len + 1 : 0;
+  if (ib->matches_count > 0) {
+    fa->offset = MAX(fa->offset, ib->matches[ib->matches_count - 1] + len);
+  }
+  fa->matches_size = MAX(ib->matches_count, 8);
+  fa->matches = g_new(guint, fa->matches_size);
+  fa->matches_count = ib->matches_count;
+  if (ib->matches_count > 0) {
+    memcpy(fa->matches, ib->matches, ib->matches_count * sizeof(guint));
+  }
+  fa->found = 0;
+  return TRUE;
+}
+
+static gboolean
+find_all_step (gpointer data)
+{
+  DocumentBox *db = data;
+  FindAllState *fa = &db->find_all;
+  gint64 deadline = g_get_monotonic_time() + FIND_ALL_SLICE;
+  guint len = strlen(db->search.str);
+  hit_index_update(db);
+  if (fa->ib != NULL) {
+    if (hit_index_contains(&db->hits, fa->ib)) {
+      fa->next_box = fa->ib->document_index;
+    } else {
+      find_all_drop_box(fa);
+    }
+  }
+  while (fa->next_box < db->hits.count &&
+         g_get_monotonic_time() < deadline) {
+    InlineBox *ib = db->hits.boxes[fa->next_box];
+    if (fa->ib == NULL && ! find_all_start_box(fa, ib, len)) {
+      fa->next_box++;
+      continue;
+    }
+    guint text_length = inline_box_get_text_length(ib);
+    guint chunk_end = MIN(fa->offset + FIND_ALL_CHUNK, text_length);
+    gint pos = inline_box_search(ib, fa->offset,
+                                 MIN(chunk_end + len - 1, text_length),
+                                 db->search.str);
+    if (pos >= 0) {
+      if (fa->matches_count == fa->matches_size) {
+        fa->matches_size *= 2;
+        fa->matches = g_renew(guint, fa->matches, fa->matches_size);
+      }
+      fa->matches[fa->matches_count++] = pos;
+      fa->found++;
+      /* Matches don't overlap */
+      fa->offset = pos + len;
+      continue;
+    }
+    fa->offset = chunk_end;
+    if (chunk_end < text_length) {
+      continue;
+    }
+    /* Done with the box */
+    ib->matches_scanned = text_length;
+    inline_box_set_matches(ib, fa->matches, fa->matches_count, len);
+    fa->matches = NULL;
+    fa->count += fa->found;
+    find_all_drop_box(fa);
+    fa->next_box++;
+  }
+  if (fa->next_box >= db->hits.count && fa->rescan) {
+    /* Only the boxes that have grown are scanned again. */
+    fa->rescan = FALSE;
+    fa->next_box = 0;
   }
+  if (fa->next_box < db->hits.count) {
+    g_signal_emit(db, signals[MATCHES], 0, fa->count + fa->found, FALSE);
+    return G_SOURCE_CONTINUE;
+  }
+  fa->source_id = 0;
+  g_signal_emit(db, signals[MATCHES], 0, fa->count, TRUE);
+  return G_SOURCE_REMOVE;
+}
+
+/* (Re)starts finding all the matches of the current search
+   string. */
+static void
+find_all_start (DocumentBox *db)
+{
+  find_all_cancel(db);
+  if (db->search.str == NULL || db->search.str[0] == 0) {
+    return;
+  }
+  db->find_all.active = TRUE;
+  db->find_all.source_id = g_idle_add(find_all_step, db);
+}
+
+/* Stops the search, removing the match highlighting. */
+void
+document_box_find_stop (DocumentBox *db)
+{
+  find_all_cancel(db);
 }
 
+/* Incremental search: when the string is extended, the search is
+   narrowed to the current match and what follows (or precedes) it;
+   otherwise it's restarted. Finding of all the matches is restarted
+   in either case. */
 gboolean
-document_box_find (DocumentBox *db, const gchar *str)
-{
-  /* Cleanup selection */
-  db->sel.selection_prev = db->sel.selection_end;
-  db->sel.selection_prev_index = db->sel.selection_end_index + 1;
-  db->sel.selection_end = db->sel.selection_start;
-  db->sel.selection_end_index = db->sel.selection_start_index;
-  selection_update(GTK_WIDGET(db), &db->sel);
-
-  /* todo: backwards search */
-  db->search.str = str;
-  db->search.state = START;
-  db->search.end = -1;
-  document_box_search(GTK_WIDGET(db), db);
-  if (db->search.state == FOUND) {
-    gtk_widget_grab_focus(GTK_WIDGET(db->search.ib));
+document_box_find (DocumentBox *db, const gchar *str, gboolean forward)
+{
+  gchar *folded = inline_box_fold(str);
+  gboolean extended = db->search.str != NULL &&
+    g_str_has_prefix(folded, db->search.str);
+  g_free(db->search.str);
+  db->search.str = folded;
+  db->search.use_regex = FALSE;
+  hit_index_update(db);
+  find_all_start(db);
+  if (extended && hit_index_contains(&db->hits, db->search.ib) &&
+      document_box_search(db, db->search.ib->document_index,
+                          forward ? db->search.start : db->search.start + 1,
+                          forward)) {
     return TRUE;
-  } else {
+  }
+  selection_clear(db);
+  db->search.ib = NULL;
+  return document_box_search_all(db, forward);
+}
+
+/* Position at which the text of a box starts in the search text:
+   boxes are separated by newlines there. */
+static guint
+search_text_offset (HitIndex *hits, guint box)
+{
+  return hits->offsets[box] + box;
+}
+
+/* Returns the index of the box containing a search text position. */
+static guint
+search_text_box (HitIndex *hits, guint pos)
+{
+  guint low = 0, high = hits->count;
+  while (high - low > 1) {
+    guint mid = (low + high) / 2;
+    if (search_text_offset(hits, mid) <= pos) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+static void
+search_text_update (DocumentBox *db)
+{
+  guint i;
+  if (db->search.text != NULL) {
+    return;
+  }
+  GString *text = g_string_sized_new(db->hits.offsets[db->hits.count] +
+                                     db->hits.count + 1);
+  for (i = 0; i < db->hits.count; i++) {
+    if (i > 0) {
+      g_string_append_c(text, '\n');
+    }
+    g_string_append_len(text, inline_box_get_text(db->hits.boxes[i]),
+                        inline_box_get_text_length(db->hits.boxes[i]));
+  }
+  db->search.text_length = text->len;
+  db->search.text = g_string_free(text, FALSE);
+}
+
+/* Searches for the current regular expression from a search text
+   position: in the forward direction, for a match at or after it; in
+   the backward one, for the last match starting before it. Empty
+   matches are skipped, since there's nothing to select. */
+static gboolean
+document_box_search_regex (DocumentBox *db, guint pos, gboolean forward)
+{
+  HitIndex *hits = &db->hits;
+  GMatchInfo *match_info = NULL;
+  gint start = -1, end = -1, s, e;
+  if (hits->count == 0 || db->search.regex == NULL) {
+    return FALSE;
+  }
+  search_text_update(db);
+  if (pos > db->search.text_length) {
+    pos = db->search.text_length;
+  }
+  g_regex_match_full(db->search.regex, db->search.text,
+                     db->search.text_length, forward ? pos : 0, 0,
+                     &match_info, NULL);
+  while (g_match_info_matches(match_info) &&
+         g_match_info_fetch_pos(match_info, 0, &s, &e) &&
+         (forward || (guint)s < pos)) {
+    if (s < e) {
+      start = s;
+      end = e;
+      if (forward) {
+        break;
+      }
+    }
+    g_match_info_next(match_info, NULL);
+  }
+  g_match_info_free(match_info);
+  if (start == -1) {
+    return FALSE;
+  }
+  guint start_box = search_text_box(hits, start);
+  guint end_box = search_text_box(hits, end - 1);
+  db->search.ib = hits->boxes[start_box];
+  db->search.start = start - search_text_offset(hits, start_box);
+  db->search.end = MIN(end - search_text_offset(hits, start_box),
+                       inline_box_get_text_length(db->search.ib));
+  db->sel.selection_start = db->search.ib;
+  db->sel.selection_start_index = db->search.start;
+  db->sel.selection_end = hits->boxes[end_box];
+  db->sel.selection_end_index =
+    MIN(end - search_text_offset(hits, end_box),
+        inline_box_get_text_length(hits->boxes[end_box]));
+  selection_update(db);
+  scroll_to_offset(db, db->search.ib, db->search.start);
+  return TRUE;
+}
+
+/* Searches for a regular expression, case-insensitively and with
+   boxes matched as lines, from the current match (or from the
+   document's beginning or end). The compiled pattern is kept for as
+   long as it doesn't change; one that fails to compile is not kept,
+   so that its error is reported again. */
+gboolean
+document_box_find_regex (DocumentBox *db, const gchar *pattern,
+                         gboolean forward, GError **error)
+{
+  find_all_cancel(db);
+  db->search.use_regex = TRUE;
+  if (g_strcmp0(pattern, db->search.pattern) != 0) {
+    if (db->search.regex != NULL) {
+      g_regex_unref(db->search.regex);
+    }
+    g_free(db->search.pattern);
+    db->search.pattern = g_strdup(pattern);
+    db->search.regex = pattern[0] == 0 ? NULL
+      : g_regex_new(pattern, G_REGEX_CASELESS | G_REGEX_MULTILINE |
+                    G_REGEX_OPTIMIZE, 0, error);
+    if (db->search.regex == NULL && pattern[0] != 0) {
+      g_free(db->search.pattern);
+      db->search.pattern = NULL;
+    }
+  }
+  hit_index_update(db);
+  if (db->search.regex == NULL) {
+    selection_clear(db);
     db->search.ib = NULL;
-    db->search.start = 0;
-    db->search.end = -1;
     return FALSE;
   }
+  if (hit_index_contains(&db->hits, db->search.ib)) {
+    guint pos = search_text_offset(&db->hits,
+                                   db->search.ib->document_index) +
+      db->search.start;
+    if (document_box_search_regex(db, forward ? pos : pos + 1, forward)) {
+      return TRUE;
+    }
+  }
+  selection_clear(db);
+  db->search.ib = NULL;
+  return document_box_search_regex(db, forward ? 0 : G_MAXUINT, forward);
+}
+
+/* Moves to the next (or previous) match of the current search
+   string. */
+gboolean
+document_box_find_next (DocumentBox *db, gboolean forward)
+{
+  hit_index_update(db);
+  if (db->search.use_regex) {
+    if (hit_index_contains(&db->hits, db->search.ib)) {
+      guint pos = search_text_offset(&db->hits,
+                                     db->search.ib->document_index) +
+        db->search.start;
+      if (document_box_search_regex(db, forward ? pos + 1 : pos, forward)) {
+        return TRUE;
+      }
+    }
+    return document_box_search_regex(db, forward ? 0 : G_MAXUINT, forward);
+  }
+  if (hit_index_contains(&db->hits, db->search.ib) &&
+      document_box_search(db, db->search.ib->document_index,
+                          forward ? db->search.end : db->search.start,
+                          forward)) {
+    return TRUE;
+  }
+  /* Wrapping around */
+  return document_box_search_all(db, forward);
 }
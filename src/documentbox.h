@@ -33,6 +33,10 @@ G_BEGIN_DECLS
 typedef struct _DocumentBox DocumentBox;
 typedef struct _DocumentBoxClass DocumentBoxClass;
 
+/* A selection between two positions, from where it started to where
+   it ends now, in any order. The range of document offsets (see
+   HitIndex) covered by it is kept as well, so that only the boxes
+   whose coverage changes are updated. */
 typedef struct _SelectionState SelectionState;
 struct _SelectionState
 {
@@ -40,37 +44,132 @@ struct _SelectionState
   guint selection_start_index;
   InlineBox *selection_end;
   guint selection_end_index;
-  InlineBox *selection_prev;
-  guint selection_prev_index;
+  guint start;
+  guint end;
   gboolean selection_active;
-  gboolean selecting;
 };
 
-typedef enum _TSState TSState;
-enum _TSState {
-  START,
-  LOOKING,
-  FOUND
+/* A range published as a selection (PRIMARY or CLIPBOARD), kept
+   between box positions like SelectionState, since document offsets
+   may shift before its text is requested. start is NULL when there
+   is none. */
+typedef struct _SelectionRange SelectionRange;
+struct _SelectionRange
+{
+  InlineBox *start;
+  guint start_index;
+  InlineBox *end;
+  guint end_index;
 };
 
+/* The last search string (case-folded), and its current match, if
+   any (ib is NULL otherwise). For regular expression search, the
+   last compiled pattern is kept along with its source, and matched
+   against the texts of all the boxes joined with newlines (built
+   when needed, till the hit index is rebuilt). */
 typedef struct _TextSearchState TextSearchState;
 struct _TextSearchState
 {
   InlineBox *ib;
-  gint start;
-  gint end;
-  const gchar *str;
-  gboolean forward;
-  TSState state;
+  guint start;
+  guint end;
+  gchar *str;
+  gboolean use_regex;
+  GRegex *regex;
+  gchar *pattern;
+  gchar *text;
+  guint text_length;
+};
+
+/* Search for all the matches of the current search string, done in
+   idle time, in time slices, so that it doesn't block input and
+   drawing on large documents. The boxes up to the next one in the
+   box index are scanned, and have their matches highlighted; boxes
+   are scanned again from where they were left if their texts grow.
+   A box may be scanned over several slices, with its matches
+   collected here till it's done. rescan is set if texts may have
+   grown during a scan, to go over the boxes again once it's
+   through. */
+typedef struct _FindAllState FindAllState;
+struct _FindAllState
+{
+  guint source_id;
+  gboolean active;
+  guint next_box;
+  guint count;
+  gboolean rescan;
+  InlineBox *ib;
+  guint offset;
+  guint *matches;
+  guint matches_count;
+  guint matches_size;
+  guint found;
+};
+
+/* An InlineBox and its allocation. */
+typedef struct _HitEntry HitEntry;
+struct _HitEntry
+{
+  InlineBox *ib;
+  GtkAllocation alloc;
+};
+
+/* The height of hit index rows, in pixels. */
+#define HIT_ROW_HEIGHT 128
+
+/* InlineBoxes in document order, with their allocations and the
+   document offsets their texts start at (and the total length in
+   the end), so that document ranges can be mapped to them. To find
+   the box at a point without walking the widget tree, the document
+   is also split into rows of HIT_ROW_HEIGHT pixels starting at
+   rows_y0, each listing the boxes overlapping it in document order
+   (as a slice of row_entries starting at rows[row]). A lookup only
+   checks the boxes in a single row, which are usually a few; a tall
+   box is listed in each row it spans. It is rebuilt lazily after
+   allocation. */
+typedef struct _HitIndex HitIndex;
+struct _HitIndex
+{
+  HitEntry *entries;
+  InlineBox **boxes;
+  guint *offsets;
+  guint count;
+  guint size;
+  guint *rows;
+  guint rows_count;
+  gint rows_y0;
+  guint *row_entries;
+  guint row_entries_size;
+  gboolean valid;
 };
 
 struct _DocumentBox
 {
   GtkScrolledWindow parent_instance;
   GtkEventBox *evbox;
-  GList *links;
+  IBFocusChain *focus_chain;
+  HitIndex hits;
+  /* Offset of the last event window relative to the event box's
+     parent window, valid till the next allocation. */
+  GdkWindow *origin_window;
+  gint origin_x;
+  gint origin_y;
+  /* Pointer motion is processed once per frame, at the last
+     position, and skipped while the pointer stays within the last
+     hovered word if there's no selection in progress. */
+  guint motion_tick_id;
+  gint motion_x;
+  gint motion_y;
+  InlineBox *hover_ib;
+  GdkRectangle hover_rect;
+  IBLink *hover_link;
   SelectionState sel;
+  /* Ranges published as PRIMARY and CLIPBOARD selections; their
+     texts are only read when requested. */
+  SelectionRange primary;
+  SelectionRange clipboard;
   TextSearchState search;
+  FindAllState find_all;
   GdkWindow *event_window;
 };
 
@@ -81,7 +180,12 @@ struct _DocumentBoxClass
 
 GType document_box_get_type(void) G_GNUC_CONST;
 DocumentBox *document_box_new(void);
-gboolean document_box_find (DocumentBox *db, const gchar *str);
+gboolean document_box_find (DocumentBox *db, const gchar *str,
+                            gboolean forward);
+gboolean document_box_find_next (DocumentBox *db, gboolean forward);
+void document_box_find_stop (DocumentBox *db);
+gboolean document_box_find_regex (DocumentBox *db, const gchar *pattern,
+                                  gboolean forward, GError **error);
 
 G_END_DECLS
 
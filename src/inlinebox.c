@@ -18,6 +18,11 @@
 #include <gtk/gtk.h>
 #include "inlinebox.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define IB_SEARCH_X86 1
+#endif
+
 
 static GtkSizeRequestMode inline_box_get_request_mode (GtkWidget *widget);
 static void inline_box_get_preferred_width(GtkWidget *widget,
@@ -49,25 +54,81 @@ static void ib_text_class_init (IBTextClass *klass)
 static void ib_text_init (IBText *self)
 {
   self->layout = NULL;
+  self->glyphs = NULL;
+  self->glyphs_count = 0;
+  self->font = NULL;
+  self->scaled_font = NULL;
+  self->has_color = FALSE;
 }
 
 static void ib_text_dispose (GObject *self)
 {
   IBText *ibt = IB_TEXT(self);
   g_clear_object(&ibt->layout);
+  g_clear_object(&ibt->font);
+  g_free(ibt->glyphs);
+  ibt->glyphs = NULL;
+}
+
+/* Collects glyphs of a simple text, see IBText. */
+static void ib_text_collect_glyphs (IBText *ibt)
+{
+  PangoLayoutLine *line = pango_layout_get_line_readonly(ibt->layout, 0);
+  if (pango_layout_get_line_count(ibt->layout) != 1 ||
+      line == NULL || line->runs == NULL || line->runs->next != NULL) {
+    return;
+  }
+  PangoGlyphItem *run = line->runs->data;
+  GSList *al;
+  for (al = run->item->analysis.extra_attrs; al; al = al->next) {
+    PangoAttribute *attr = al->data;
+    if (attr->klass->type == PANGO_ATTR_FOREGROUND) {
+      ibt->has_color = TRUE;
+      ibt->color = ((PangoAttrColor*)attr)->color;
+    } else {
+      return;
+    }
+  }
+  cairo_scaled_font_t *scaled_font =
+    pango_cairo_font_get_scaled_font(PANGO_CAIRO_FONT(run->item->analysis.font));
+  if (scaled_font == NULL) {
+    return;
+  }
+
+  gint i, x = 0, baseline = pango_layout_get_baseline(ibt->layout);
+  ibt->glyphs = g_new(cairo_glyph_t, run->glyphs->num_glyphs);
+  for (i = 0; i < run->glyphs->num_glyphs; i++) {
+    PangoGlyphInfo *gi = &run->glyphs->glyphs[i];
+    if (gi->glyph & PANGO_GLYPH_UNKNOWN_FLAG) {
+      /* Rendered as hex boxes by Pango */
+      g_free(ibt->glyphs);
+      ibt->glyphs = NULL;
+      ibt->glyphs_count = 0;
+      return;
+    }
+    if (gi->glyph != PANGO_GLYPH_EMPTY) {
+      ibt->glyphs[ibt->glyphs_count].index = gi->glyph;
+      ibt->glyphs[ibt->glyphs_count].x =
+        (double)(x + gi->geometry.x_offset) / PANGO_SCALE;
+      ibt->glyphs[ibt->glyphs_count].y =
+        (double)(baseline + gi->geometry.y_offset) / PANGO_SCALE;
+      ibt->glyphs_count++;
+    }
+    x += gi->geometry.width;
+  }
+  ibt->font = g_object_ref(run->item->analysis.font);
+  ibt->scaled_font = scaled_font;
 }
 
 IBText *ib_text_new (PangoLayout *layout)
 {
   IBText *ib_text = g_object_new (IB_TEXT_TYPE, NULL);
-  PangoRectangle extents;
-  pango_layout_get_pixel_extents(layout, NULL, &extents);
-  ib_text->alloc.x = 0;
-  ib_text->alloc.y = 0;
-  ib_text->alloc.width = extents.width;
-  ib_text->alloc.height = extents.height;
+  pango_layout_get_pixel_extents(layout, &ib_text->ink, &ib_text->logical);
+  ib_text->baseline = pango_layout_get_baseline(layout) / PANGO_SCALE;
+  ib_text->length = strlen(pango_layout_get_text(layout));
   ib_text->layout = layout;
   g_object_ref(layout);
+  ib_text_collect_glyphs(ib_text);
   return IB_TEXT (ib_text);
 }
 
@@ -80,7 +141,6 @@ static void ib_link_class_init (IBLinkClass *klass)
 static void ib_link_init (IBLink *self)
 {
   self->url = NULL;
-  self->objects = NULL;
 }
 
 static void ib_link_dispose (GObject *self)
@@ -98,103 +158,862 @@ IBLink *ib_link_new (const gchar *url)
 }
 
 
-static void ib_break_class_init (IBBreakClass *klass)
+G_DEFINE_TYPE (IBLink, ib_link, G_TYPE_OBJECT);
+G_DEFINE_TYPE (IBText, ib_text, G_TYPE_OBJECT);
+G_DEFINE_TYPE (InlineBox, inline_box, GTK_TYPE_CONTAINER);
+
+
+/* Text length of a child, including its trailing space. */
+guint
+inline_box_child_length (InlineBox *ib, guint i)
 {
-  return;
+  if (ib->kind[i] != IB_CHILD_TEXT) {
+    return 0;
+  }
+  return IB_TEXT(ib->object[i])->length +
+    (ib->space[i] != NULL ? ib->space[i]->length : 0);
 }
 
-static void ib_break_init (IBBreak *self)
+static gint
+inline_box_space_width (InlineBox *ib, guint i)
 {
-  return;
+  return ib->space[i] != NULL ? ib->space[i]->logical.width : 0;
 }
 
-IBBreak *ib_break_new ()
+/* Returns the x position (in pixels, relative to the child) of a
+   given index in a text child, which may point into its trailing
+   space. */
+static gint
+inline_box_index_to_x (InlineBox *ib, guint i, guint index)
 {
-  return g_object_new (IB_BREAK_TYPE, NULL);
+  IBText *ibt = ib->object[i];
+  gint x_pos;
+  if (index > ibt->length) {
+    return ib->width[i] + inline_box_space_width(ib, i);
+  } else if (index == ibt->length) {
+    return ib->width[i];
+  }
+  pango_layout_index_to_line_x(ibt->layout, index, FALSE, NULL, &x_pos);
+  return x_pos / PANGO_SCALE;
 }
 
+static void
+inline_box_draw_selection (InlineBox *ib, GtkStyleContext *styleCtx,
+                           cairo_t *cr, guint i)
+{
+  guint text_position = ib->offset[i];
+  guint text_len = inline_box_child_length(ib, i);
+  if (ib->selection_start <= text_position + text_len &&
+      ib->selection_end >= text_position) {
+    gint full_width = ib->width[i] + inline_box_space_width(ib, i);
+    gint sel_start = ib->x[i], sel_width = full_width;
+    gint x_pos;
+    if (ib->selection_start > text_position) {
+      x_pos = inline_box_index_to_x(ib, i,
+                                    ib->selection_start - text_position);
+      sel_start += x_pos;
+      sel_width -= x_pos;
+    }
+    if (ib->selection_end < text_position + text_len) {
+      x_pos = inline_box_index_to_x(ib, i,
+                                    ib->selection_end - text_position);
+      sel_width -= full_width - x_pos;
+    }
+    /* todo: the following seems to render "inactive" selection,
+       but would be nice to render an active one */
+    gtk_style_context_add_class(styleCtx, "rubberband");
+    gtk_render_background(styleCtx, cr, sel_start, ib->y[i],
+                          sel_width, ib->height[i]);
+    gtk_style_context_remove_class(styleCtx, "rubberband");
+  }
+}
 
-G_DEFINE_TYPE (IBLink, ib_link, G_TYPE_OBJECT);
-G_DEFINE_TYPE (IBBreak, ib_break, G_TYPE_OBJECT);
-G_DEFINE_TYPE (IBText, ib_text, G_TYPE_OBJECT);
-G_DEFINE_TYPE (InlineBox, inline_box, GTK_TYPE_CONTAINER);
-
+/* Highlights search matches on a line, with the theme's selection
+   colour (or the text one, if it has none), translucent so that they
+   differ from the selection. */
+static void
+inline_box_draw_matches (InlineBox *ib, GtkStyleContext *styleCtx,
+                         cairo_t *cr, guint line, double x1, double x2)
+{
+  guint line_offset = ib->lines[line].offset;
+  guint line_end_offset = (line + 1 < ib->lines_count)
+    ? ib->lines[line + 1].offset : ib->text_length;
+  guint line_end = (line + 1 < ib->lines_count)
+    ? ib->lines[line + 1].first : ib->children_count;
+  guint low = 0, high = ib->matches_count, m, i;
+  /* The first match ending after the line's start */
+  while (low < high) {
+    guint mid = (low + high) / 2;
+    if (ib->matches[mid] + ib->matches_length <= line_offset) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  if (low == ib->matches_count || ib->matches[low] >= line_end_offset) {
+    return;
+  }
+  GdkRGBA color;
+  if (! gtk_style_context_lookup_color(styleCtx, "theme_selected_bg_color",
+                                       &color)) {
+    gtk_style_context_get_color(styleCtx,
+                                gtk_style_context_get_state(styleCtx),
+                                &color);
+  }
+  cairo_save(cr);
+  cairo_set_source_rgba(cr, color.red, color.green, color.blue,
+                        color.alpha * 0.4);
+  for (m = low; m < ib->matches_count && ib->matches[m] < line_end_offset;
+       m++) {
+    guint start = ib->matches[m], end = start + ib->matches_length;
+    for (i = MAX(inline_box_find_offset(ib, start), ib->lines[line].first);
+         i < line_end && ib->offset[i] < end; i++) {
+      guint text_len = inline_box_child_length(ib, i);
+      if (ib->kind[i] != IB_CHILD_TEXT || ib->offset[i] + text_len <= start ||
+          ib->x[i] > x2 ||
+          ib->x[i] + ib->width[i] + inline_box_space_width(ib, i) < x1) {
+        continue;
+      }
+      gint start_x = inline_box_index_to_x
+        (ib, i, start > ib->offset[i] ? start - ib->offset[i] : 0);
+      gint end_x = inline_box_index_to_x
+        (ib, i, MIN(end - ib->offset[i], text_len));
+      cairo_rectangle(cr, ib->x[i] + start_x, ib->y[i],
+                      end_x - start_x, ib->height[i]);
+    }
+  }
+  cairo_fill(cr);
+  cairo_restore(cr);
+}
 
+/* Returns the widget child a link consists of, if it has no text
+   (e.g., a link around an image), or -1. */
 static gint
-inline_box_draw (GtkWidget *widget,
-                 cairo_t   *cr)
+inline_box_link_widget (InlineBox *ib, IBLink *link)
 {
-  GList *child;
-  InlineBox *ib = INLINE_BOX(widget);
-  guint text_position = 0;
-  for (child = ib->children; child; child = child->next) {
-    if (GTK_IS_WIDGET(child->data)) {
-      gtk_container_propagate_draw((GTK_CONTAINER(widget)),
-                                   GTK_WIDGET(child->data), cr);
-      /* todo: render focus around widgets (images in particular)
-         too */
-    } else if (IS_IB_TEXT(child->data)) {
-      IBText *ibt = IB_TEXT(child->data);
-      GtkAllocation alloc;
-      GtkStyleContext *styleCtx = gtk_widget_get_style_context(widget);
-      guint text_len = strlen(pango_layout_get_text(ibt->layout));
-      gtk_widget_get_allocation (widget, &alloc);
-      cairo_translate (cr, -alloc.x, -alloc.y);
-
-      if (ib->selection_start <= text_position + text_len &&
-          ib->selection_end >= text_position) {
-        guint sel_start = ibt->alloc.x, sel_width = ibt->alloc.width;
-        gint x_pos;
-        if (ib->selection_start > text_position) {
-          pango_layout_index_to_line_x(ibt->layout,
-                                       ib->selection_start - text_position,
-                                       FALSE, NULL, &x_pos);
-          sel_start += x_pos / PANGO_SCALE;
-          sel_width -= x_pos / PANGO_SCALE;
+  guint i;
+  if (link->end > link->start) {
+    return -1;
+  }
+  for (i = 0; i < ib->widget_links_count; i++) {
+    if (ib->widget_links[i].link == link) {
+      return ib->widget_links[i].child;
+    }
+  }
+  return -1;
+}
+
+static void
+inline_box_draw_focus (InlineBox *ib, GtkStyleContext *styleCtx,
+                       cairo_t *cr, guint i)
+{
+  guint text_position = ib->offset[i];
+  guint text_len = inline_box_child_length(ib, i);
+  IBLink *ibl = IB_LINK(ib->focused_object);
+  if (ibl->start <= text_position + text_len &&
+      ibl->end > text_position) {
+    int start_index = 0, end_index = text_len;
+    if (ibl->start > text_position) {
+      start_index = ibl->start - text_position;
+    }
+    if (ibl->end < text_position + text_len) {
+      end_index = ibl->end - text_position;
+    }
+    int start_x = inline_box_index_to_x(ib, i, start_index);
+    int end_x = inline_box_index_to_x(ib, i, end_index);
+    gtk_render_focus(styleCtx, cr,
+                     ib->x[i] + start_x,
+                     ib->y[i],
+                     end_x - start_x,
+                     ib->height[i]);
+  }
+}
+
+/* Glyphs of consecutive texts with the same font and colour, which
+   are drawn at once. */
+typedef struct _IBGlyphRun IBGlyphRun;
+struct _IBGlyphRun
+{
+  IBText *style;
+  cairo_glyph_t *glyphs;
+  guint count;
+  guint size;
+};
+
+static void
+inline_box_glyph_run_flush (IBGlyphRun *run, cairo_t *cr, GdkRGBA *color)
+{
+  if (run->count == 0) {
+    return;
+  }
+  cairo_set_scaled_font(cr, run->style->scaled_font);
+  if (run->style->has_color) {
+    cairo_set_source_rgb(cr,
+                         run->style->color.red / 65535.0,
+                         run->style->color.green / 65535.0,
+                         run->style->color.blue / 65535.0);
+  } else {
+    gdk_cairo_set_source_rgba(cr, color);
+  }
+  cairo_show_glyphs(cr, run->glyphs, run->count);
+  run->count = 0;
+}
+
+static void
+inline_box_glyph_run_add (IBGlyphRun *run, cairo_t *cr, GdkRGBA *color,
+                          IBText *ibt, gint x, gint y)
+{
+  if (run->count > 0 &&
+      (run->style->scaled_font != ibt->scaled_font ||
+       run->style->has_color != ibt->has_color ||
+       (ibt->has_color &&
+        (run->style->color.red != ibt->color.red ||
+         run->style->color.green != ibt->color.green ||
+         run->style->color.blue != ibt->color.blue)))) {
+    inline_box_glyph_run_flush(run, cr, color);
+  }
+  if (run->count + ibt->glyphs_count > run->size) {
+    run->size = MAX(run->size * 2, run->count + ibt->glyphs_count);
+    run->glyphs = g_renew(cairo_glyph_t, run->glyphs, run->size);
+  }
+  guint i;
+  for (i = 0; i < ibt->glyphs_count; i++) {
+    run->glyphs[run->count].index = ibt->glyphs[i].index;
+    run->glyphs[run->count].x = ibt->glyphs[i].x + x;
+    run->glyphs[run->count].y = ibt->glyphs[i].y + y;
+    run->count++;
+  }
+  run->style = ibt;
+}
+
+/* Draws a text's layout on its own, letting GTK draw it along with
+   its shadow if there is one. */
+static void
+inline_box_show_layout (InlineBox *ib, GtkStyleContext *styleCtx,
+                        cairo_t *cr, GdkRGBA *color, gint x, gint y,
+                        PangoLayout *layout)
+{
+  if (ib->text_shadow) {
+    gtk_render_layout(styleCtx, cr, x, y, layout);
+  } else {
+    gdk_cairo_set_source_rgba(cr, color);
+    cairo_move_to(cr, x, y);
+    pango_cairo_show_layout(cr, layout);
+  }
+}
+
+/* Returns the index of the last line starting at or above y. */
+static guint
+inline_box_line_at_y (InlineBox *ib, gint y)
+{
+  guint low = 0, high = ib->lines_count;
+  while (high - low > 1) {
+    guint mid = (low + high) / 2;
+    if (ib->lines[mid].y <= y) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+/* Draws the lines intersecting a given area (in widget coordinates),
+   either texts or widgets; lines and children are positioned in
+   parent coordinates, while the context is in the widget's ones.
+
+   Texts are drawn line by line: search match and selection
+   backgrounds first, then glyphs (merged into runs where possible),
+   then the focus. */
+static void
+inline_box_draw_area (InlineBox *ib, cairo_t *cr,
+                      double x1, double y1, double x2, double y2,
+                      gboolean texts)
+{
+  IBGlyphRun run = { NULL, ib->run_glyphs, 0, ib->run_glyphs_size };
+  GtkWidget *widget = GTK_WIDGET(ib);
+  GtkStyleContext *styleCtx = gtk_widget_get_style_context(widget);
+  GtkAllocation alloc;
+  GdkRGBA color;
+  guint i, line, line_start, line_end;
+  gboolean selection = FALSE, focus = FALSE;
+  gtk_widget_get_allocation (widget, &alloc);
+  x1 += alloc.x;
+  x2 += alloc.x;
+  y1 += alloc.y;
+  y2 += alloc.y;
+  line = inline_box_line_at_y(ib, y1);
+  /* Ink may extend beyond the logical extents, so including the
+     preceding line as well. */
+  if (line > 0) {
+    line--;
+  }
+
+  if (! texts) {
+    for (; line < ib->lines_count && ib->lines[line].y <= y2; line++) {
+      line_end = (line + 1 < ib->lines_count)
+        ? ib->lines[line + 1].first : ib->children_count;
+      for (i = ib->lines[line].first; i < line_end; i++) {
+        if (ib->kind[i] == IB_CHILD_WIDGET) {
+          gtk_container_propagate_draw((GTK_CONTAINER(widget)),
+                                       GTK_WIDGET(ib->object[i]), cr);
+          if (IS_IB_LINK(ib->focused_object) &&
+              inline_box_link_widget(ib, IB_LINK(ib->focused_object)) ==
+              (gint)i) {
+            gtk_render_focus(styleCtx, cr,
+                             ib->x[i] - alloc.x, ib->y[i] - alloc.y,
+                             ib->width[i], ib->height[i]);
+          }
         }
-        if (ib->selection_end < text_position + text_len) {
-          pango_layout_index_to_line_x(ibt->layout,
-                                       ib->selection_end - text_position,
-                                       FALSE, NULL, &x_pos);
-          sel_width -= ibt->alloc.width - x_pos / PANGO_SCALE;
+      }
+    }
+    return;
+  }
+
+  gtk_style_context_get_color(styleCtx,
+                              gtk_style_context_get_state(styleCtx),
+                              &color);
+  cairo_save(cr);
+  cairo_translate (cr, -alloc.x, -alloc.y);
+  for (; line < ib->lines_count && ib->lines[line].y <= y2; line++) {
+    line_start = ib->lines[line].first;
+    line_end = (line + 1 < ib->lines_count)
+      ? ib->lines[line + 1].first : ib->children_count;
+    if (line_start == line_end) {
+      continue;
+    }
+    selection = ib->selection_end > 0 &&
+      ib->selection_start <= (line + 1 < ib->lines_count
+                              ? ib->lines[line + 1].offset
+                              : ib->text_length) &&
+      ib->selection_end >= ib->lines[line].offset;
+    focus = IS_IB_LINK(ib->focused_object);
+
+    if (ib->matches_count > 0) {
+      inline_box_draw_matches(ib, styleCtx, cr, line, x1, x2);
+    }
+
+    if (selection) {
+      for (i = line_start; i < line_end; i++) {
+        if (ib->kind[i] == IB_CHILD_TEXT && ib->x[i] <= x2 &&
+            ib->x[i] + ib->width[i] + inline_box_space_width(ib, i) >= x1) {
+          inline_box_draw_selection(ib, styleCtx, cr, i);
         }
-        /* todo: the following seems to render "inactive" selection,
-           but would be nice to render an active one */
-        gtk_style_context_add_class(styleCtx, "rubberband");
-        gtk_render_background(styleCtx, cr, sel_start, ibt->alloc.y,
-                              sel_width, ibt->alloc.height);
-        gtk_style_context_remove_class(styleCtx, "rubberband");
       }
+    }
 
-      gtk_render_layout(styleCtx, cr, ibt->alloc.x, ibt->alloc.y, ibt->layout);
-
-      if (ib->focused_object) {
-        if (IS_IB_LINK(ib->focused_object)) {
-          IBLink *ibl = IB_LINK(ib->focused_object);
-          if (ibl->start <= text_position + text_len &&
-              ibl->end > text_position) {
-            int start_index = 0, end_index = text_len;
-            if (ibl->start > text_position) {
-              start_index = ibl->start - text_position;
-            }
-            if (ibl->end < text_position + text_len) {
-              end_index = ibl->end - text_position;
-            }
-            int start_x = 0, end_x = 0;
-            pango_layout_index_to_line_x(ibt->layout, start_index,
-                                         0, NULL, &start_x);
-            pango_layout_index_to_line_x(ibt->layout, end_index,
-                                         0, NULL, &end_x);
-            gtk_render_focus(styleCtx, cr,
-                             ibt->alloc.x + start_x / PANGO_SCALE,
-                             ibt->alloc.y,
-                             (end_x - start_x) / PANGO_SCALE,
-                             ibt->alloc.height);
-          }
+    for (i = line_start; i < line_end; i++) {
+      if (ib->kind[i] != IB_CHILD_TEXT || ib->x[i] > x2 ||
+          ib->x[i] + ib->width[i] + inline_box_space_width(ib, i) < x1) {
+        continue;
+      }
+      IBText *ibt = IB_TEXT(ib->object[i]);
+      if (ibt->glyphs != NULL && ! ib->text_shadow) {
+        inline_box_glyph_run_add(&run, cr, &color, ibt, ib->x[i], ib->y[i]);
+      } else {
+        inline_box_glyph_run_flush(&run, cr, &color);
+        inline_box_show_layout(ib, styleCtx, cr, &color,
+                               ib->x[i], ib->y[i], ibt->layout);
+      }
+      /* Plain spaces are blank, but they may be underlined, for
+         instance. */
+      if (ib->space[i] != NULL && ib->space[i]->glyphs == NULL) {
+        inline_box_glyph_run_flush(&run, cr, &color);
+        inline_box_show_layout(ib, styleCtx, cr, &color,
+                               ib->x[i] + ib->width[i], ib->y[i],
+                               ib->space[i]->layout);
+      }
+    }
+    inline_box_glyph_run_flush(&run, cr, &color);
+
+    if (focus) {
+      for (i = line_start; i < line_end; i++) {
+        if (ib->kind[i] == IB_CHILD_TEXT && ib->x[i] <= x2 &&
+            ib->x[i] + ib->width[i] + inline_box_space_width(ib, i) >= x1) {
+          inline_box_draw_focus(ib, styleCtx, cr, i);
         }
       }
-      cairo_translate (cr, alloc.x, alloc.y);
-      text_position += text_len;
+    }
+  }
+  cairo_restore(cr);
+  ib->run_glyphs = run.glyphs;
+  ib->run_glyphs_size = run.size;
+}
+
+
+/* Rendered text cache. Rendering text is relatively slow, while most
+   of the boxes don't change once loaded, so their texts can be
+   rendered into image surfaces, which are reused while scrolling.
+   The cache is shared between all the boxes, and least recently used
+   bands are evicted once it's over the size limit. It's disabled if
+   the limit is 0. */
+
+struct _IBBand
+{
+  InlineBox *ib;
+  guint index;
+  cairo_surface_t *surface;
+  gsize size;
+  GList link;
+};
+
+static GQueue render_cache = G_QUEUE_INIT;
+static gsize render_cache_used = 0;
+static gsize render_cache_size = 0;
+
+static void
+inline_box_band_free (IBBand *band)
+{
+  g_queue_unlink(&render_cache, &band->link);
+  render_cache_used -= band->size;
+  band->ib->bands[band->index] = NULL;
+  cairo_surface_destroy(band->surface);
+  g_free(band);
+}
+
+static void
+inline_box_drop_bands (InlineBox *ib)
+{
+  guint i;
+  for (i = 0; i < ib->bands_count; i++) {
+    if (ib->bands[i] != NULL) {
+      inline_box_band_free(ib->bands[i]);
+    }
+  }
+  g_free(ib->bands);
+  ib->bands = NULL;
+  ib->bands_count = 0;
+}
+
+void
+inline_box_set_render_cache_size (gsize size)
+{
+  render_cache_size = size;
+  while (render_cache_used > render_cache_size) {
+    inline_box_band_free(g_queue_peek_tail_link(&render_cache)->data);
+  }
+}
+
+/* Checks whether the bands are still valid, updating the state and
+   dropping the bands if they aren't. */
+static gboolean
+inline_box_bands_valid (InlineBox *ib)
+{
+  GtkAllocation alloc;
+  gtk_widget_get_allocation (GTK_WIDGET(ib), &alloc);
+  gint scale = gtk_widget_get_scale_factor(GTK_WIDGET(ib));
+  if (ib->bands_generation == ib->generation &&
+      ib->bands_width == alloc.width &&
+      ib->bands_scale == scale &&
+      ib->bands_selection_start == ib->selection_start &&
+      ib->bands_selection_end == ib->selection_end &&
+      ib->bands_focused_object == ib->focused_object &&
+      ib->bands_matches_generation == ib->matches_generation) {
+    return TRUE;
+  }
+  inline_box_drop_bands(ib);
+  ib->bands_generation = ib->generation;
+  ib->bands_width = alloc.width;
+  ib->bands_scale = scale;
+  ib->bands_selection_start = ib->selection_start;
+  ib->bands_selection_end = ib->selection_end;
+  ib->bands_focused_object = ib->focused_object;
+  ib->bands_matches_generation = ib->matches_generation;
+  return FALSE;
+}
+
+static IBBand *
+inline_box_get_band (InlineBox *ib, guint index)
+{
+  GtkWidget *widget = GTK_WIDGET(ib);
+  GtkAllocation alloc;
+  gtk_widget_get_allocation (widget, &alloc);
+  if (ib->bands == NULL) {
+    ib->bands_count = alloc.height / IB_BAND_HEIGHT + 1;
+    ib->bands = g_new0(IBBand*, ib->bands_count);
+  }
+  if (index >= ib->bands_count) {
+    return NULL;
+  }
+
+  IBBand *band = ib->bands[index];
+  if (band != NULL) {
+    g_queue_unlink(&render_cache, &band->link);
+    g_queue_push_head_link(&render_cache, &band->link);
+    return band;
+  }
+
+  gint height = MIN(IB_BAND_HEIGHT, alloc.height - index * IB_BAND_HEIGHT);
+  gint scale = gtk_widget_get_scale_factor(widget);
+  gsize size = (gsize)alloc.width * height * scale * scale * 4;
+  if (alloc.width <= 0 || height <= 0 || size > render_cache_size) {
+    return NULL;
+  }
+  while (render_cache_used + size > render_cache_size) {
+    inline_box_band_free(g_queue_peek_tail_link(&render_cache)->data);
+  }
+
+  band = g_new(IBBand, 1);
+  band->ib = ib;
+  band->index = index;
+  band->size = size;
+  band->surface =
+    gdk_window_create_similar_image_surface(gtk_widget_get_window(widget),
+                                            CAIRO_FORMAT_ARGB32,
+                                            alloc.width * scale,
+                                            height * scale,
+                                            scale);
+  band->link.data = band;
+  band->link.prev = NULL;
+  band->link.next = NULL;
+  g_queue_push_head_link(&render_cache, &band->link);
+  render_cache_used += size;
+  ib->bands[index] = band;
+
+  cairo_t *band_cr = cairo_create(band->surface);
+  cairo_translate(band_cr, 0, - (double)index * IB_BAND_HEIGHT);
+  inline_box_draw_area(ib, band_cr, 0, index * IB_BAND_HEIGHT,
+                       alloc.width, index * IB_BAND_HEIGHT + height, TRUE);
+  cairo_destroy(band_cr);
+  return band;
+}
+
+static gint
+inline_box_draw (GtkWidget *widget,
+                 cairo_t   *cr)
+{
+  InlineBox *ib = INLINE_BOX(widget);
+  double clip_x1, clip_y1, clip_x2, clip_y2;
+  if (ib->lines_count == 0) {
+    return FALSE;
+  }
+  cairo_clip_extents(cr, &clip_x1, &clip_y1, &clip_x2, &clip_y2);
+  /* Boxes are only cached if they didn't change since the last
+     drawing, so that the ones being loaded or selected don't churn the
+     cache. */
+  if (render_cache_size > 0 && inline_box_bands_valid(ib)) {
+    guint index, last = clip_y2 < 0 ? 0 : clip_y2 / IB_BAND_HEIGHT;
+    for (index = clip_y1 < 0 ? 0 : clip_y1 / IB_BAND_HEIGHT;
+         index <= last; index++) {
+      IBBand *band = inline_box_get_band(ib, index);
+      if (band != NULL) {
+        cairo_set_source_surface(cr, band->surface,
+                                 0, index * IB_BAND_HEIGHT);
+        cairo_paint(cr);
+      } else {
+        inline_box_draw_area(ib, cr, clip_x1,
+                             MAX(clip_y1, index * IB_BAND_HEIGHT),
+                             clip_x2,
+                             MIN(clip_y2, (index + 1) * IB_BAND_HEIGHT),
+                             TRUE);
+      }
+    }
+  } else {
+    inline_box_draw_area(ib, cr, clip_x1, clip_y1, clip_x2, clip_y2, TRUE);
+  }
+  inline_box_draw_area(ib, cr, clip_x1, clip_y1, clip_x2, clip_y2, FALSE);
+  return FALSE;
+}
+
+/* Whether the theme draws text shadows, which glyph runs don't.
+   There is no getter for text-shadow, so a probe text is drawn with
+   gtk_render_layout and without it, and the results are compared.
+   That is done once per theme: the answer is kept on the screen's
+   settings, and forgotten when the theme changes. */
+#define TEXT_SHADOW_KEY "inline-box-text-shadow"
+#define TEXT_SHADOW_PROBE_SIZE 64
+
+static void
+inline_box_text_shadow_reset (GtkSettings *settings, GParamSpec *pspec,
+                              gpointer data)
+{
+  g_object_set_data(G_OBJECT(settings), TEXT_SHADOW_KEY, NULL);
+}
+
+static gboolean
+inline_box_text_shadow_probe (GtkWidget *widget)
+{
+  GtkStyleContext *styleCtx = gtk_widget_get_style_context(widget);
+  PangoLayout *layout = gtk_widget_create_pango_layout(widget, "Xg");
+  cairo_surface_t *surface[2];
+  GdkRGBA color;
+  gint i;
+  gtk_style_context_get_color(styleCtx,
+                              gtk_style_context_get_state(styleCtx),
+                              &color);
+  for (i = 0; i < 2; i++) {
+    surface[i] = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                                            TEXT_SHADOW_PROBE_SIZE,
+                                            TEXT_SHADOW_PROBE_SIZE);
+    cairo_t *cr = cairo_create(surface[i]);
+    if (i == 0) {
+      gtk_render_layout(styleCtx, cr, TEXT_SHADOW_PROBE_SIZE / 4,
+                        TEXT_SHADOW_PROBE_SIZE / 4, layout);
+    } else {
+      gdk_cairo_set_source_rgba(cr, &color);
+      cairo_move_to(cr, TEXT_SHADOW_PROBE_SIZE / 4,
+                    TEXT_SHADOW_PROBE_SIZE / 4);
+      pango_cairo_show_layout(cr, layout);
+    }
+    cairo_destroy(cr);
+    cairo_surface_flush(surface[i]);
+  }
+  gboolean shadow =
+    memcmp(cairo_image_surface_get_data(surface[0]),
+           cairo_image_surface_get_data(surface[1]),
+           cairo_image_surface_get_stride(surface[0]) *
+           TEXT_SHADOW_PROBE_SIZE) != 0;
+  cairo_surface_destroy(surface[0]);
+  cairo_surface_destroy(surface[1]);
+  g_object_unref(layout);
+  return shadow;
+}
+
+static gboolean
+inline_box_has_text_shadow (GtkWidget *widget)
+{
+  GObject *settings = G_OBJECT(gtk_widget_get_settings(widget));
+  gint cached = GPOINTER_TO_INT(g_object_get_data(settings,
+                                                  TEXT_SHADOW_KEY));
+  if (cached == 0) {
+    if (g_object_get_data(settings, TEXT_SHADOW_KEY "-watched") == NULL) {
+      g_signal_connect(settings, "notify::gtk-theme-name",
+                       G_CALLBACK(inline_box_text_shadow_reset), NULL);
+      g_signal_connect(settings, "notify::gtk-application-prefer-dark-theme",
+                       G_CALLBACK(inline_box_text_shadow_reset), NULL);
+      g_object_set_data(settings, TEXT_SHADOW_KEY "-watched",
+                        GINT_TO_POINTER(1));
+    }
+    cached = inline_box_text_shadow_probe(widget) ? 2 : 1;
+    g_object_set_data(settings, TEXT_SHADOW_KEY, GINT_TO_POINTER(cached));
+  }
+  return cached == 2;
+}
+
+static void
+inline_box_style_updated (GtkWidget *widget)
+{
+  InlineBox *ib = INLINE_BOX(widget);
+  GTK_WIDGET_CLASS(inline_box_parent_class)->style_updated(widget);
+  ib->text_shadow = inline_box_has_text_shadow(widget);
+  inline_box_drop_bands(ib);
+}
+
+/* Returns the index of the line containing a given child. */
+static guint
+inline_box_line_of_child (InlineBox *ib, guint child)
+{
+  guint low = 0, high = ib->lines_count;
+  while (high - low > 1) {
+    guint mid = (low + high) / 2;
+    if (ib->lines[mid].first <= child) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+/* Invalidates the area covered by the texts between given offsets,
+   with a small margin for focus outlines. */
+void
+inline_box_queue_draw_range (InlineBox *ib, guint start, guint end)
+{
+  GtkWidget *widget = GTK_WIDGET(ib);
+  GtkAllocation alloc;
+  const gint margin = 2;
+  if (ib->lines_count == 0 || ib->children_count == 0) {
+    gtk_widget_queue_draw(widget);
+    return;
+  }
+  gtk_widget_get_allocation(widget, &alloc);
+  guint first = inline_box_find_offset(ib, start);
+  guint last = inline_box_find_offset(ib, end);
+  guint first_line = inline_box_line_of_child(ib, first);
+  guint last_line = inline_box_line_of_child(ib, last);
+  gint x1 = ib->x[first] - alloc.x - margin;
+  gint x2 = ib->x[last] - alloc.x + margin;
+  if (ib->kind[last] == IB_CHILD_TEXT) {
+    x2 += ib->width[last] + inline_box_space_width(ib, last);
+  }
+  gint y1 = ib->lines[first_line].y - alloc.y - margin;
+  gint y2 = ib->lines[last_line].y + ib->lines[last_line].height
+    - alloc.y + margin;
+  if (first_line == last_line) {
+    gtk_widget_queue_draw_area(widget, x1, y1, x2 - x1, y2 - y1);
+    return;
+  }
+  /* The tail of the first line, the lines in between, and the head
+     of the last one. */
+  gint first_bottom = ib->lines[first_line + 1].y - alloc.y;
+  gint last_top = ib->lines[last_line].y - alloc.y;
+  gtk_widget_queue_draw_area(widget, x1, y1, alloc.width - x1,
+                             first_bottom - y1);
+  if (last_top > first_bottom) {
+    gtk_widget_queue_draw_area(widget, 0, first_bottom,
+                               alloc.width, last_top - first_bottom);
+  }
+  gtk_widget_queue_draw_area(widget, 0, last_top, x2, y2 - last_top);
+}
+
+/* Updates the selection, invalidating the parts that changed. */
+void
+inline_box_set_selection (InlineBox *ib, guint start, guint end)
+{
+  guint old_start = ib->selection_start, old_end = ib->selection_end;
+  if (old_start == start && old_end == end) {
+    return;
+  }
+  ib->selection_start = start;
+  ib->selection_end = end;
+  if (old_end == 0 || end == 0 || old_end < start || end < old_start) {
+    /* Disjoint selections */
+    if (old_end > 0) {
+      inline_box_queue_draw_range(ib, old_start, old_end);
+    }
+    if (end > 0) {
+      inline_box_queue_draw_range(ib, start, end);
+    }
+    return;
+  }
+  if (old_start != start) {
+    inline_box_queue_draw_range(ib, MIN(old_start, start),
+                                MAX(old_start, start));
+  }
+  if (old_end != end) {
+    inline_box_queue_draw_range(ib, MIN(old_end, end), MAX(old_end, end));
+  }
+}
+
+/* Sets search matches to highlight, taking ownership of the array of
+   their offsets; NULL clears them. */
+void
+inline_box_set_matches (InlineBox *ib, guint *matches, guint count,
+                        guint length)
+{
+  if (ib->matches_count == 0 && count == 0) {
+    g_free(matches);
+    return;
+  }
+  g_free(ib->matches);
+  ib->matches = matches;
+  ib->matches_count = count;
+  ib->matches_length = length;
+  ib->matches_generation++;
+  gtk_widget_queue_draw(GTK_WIDGET(ib));
+}
+
+/* Invalidates the focused link, if any; widgets draw their own
+   focus. */
+static void
+inline_box_queue_draw_focus (InlineBox *ib)
+{
+  if (IS_IB_LINK(ib->focused_object)) {
+    gint child = inline_box_link_widget(ib, IB_LINK(ib->focused_object));
+    if (child >= 0) {
+      GtkAllocation alloc;
+      const gint margin = 2;
+      gtk_widget_get_allocation(GTK_WIDGET(ib), &alloc);
+      gtk_widget_queue_draw_area(GTK_WIDGET(ib),
+                                 ib->x[child] - alloc.x - margin,
+                                 ib->y[child] - alloc.y - margin,
+                                 ib->width[child] + 2 * margin,
+                                 ib->height[child] + 2 * margin);
+    } else {
+      inline_box_queue_draw_range(ib, IB_LINK(ib->focused_object)->start,
+                                  IB_LINK(ib->focused_object)->end);
+    }
+  }
+}
+
+IBFocusChain *
+ib_focus_chain_new ()
+{
+  IBFocusChain *chain = g_new(IBFocusChain, 1);
+  chain->objects = g_ptr_array_new();
+  chain->boxes = g_ptr_array_new();
+  chain->current = -1;
+  return chain;
+}
+
+void
+ib_focus_chain_free (IBFocusChain *chain)
+{
+  g_ptr_array_free(chain->objects, TRUE);
+  g_ptr_array_free(chain->boxes, TRUE);
+  g_free(chain);
+}
+
+/* Sets the current position, removing focus from the previous box. */
+static void
+ib_focus_chain_set_current (IBFocusChain *chain, gint position)
+{
+  if (chain->current >= 0 &&
+      (position < 0 ||
+       g_ptr_array_index(chain->boxes, chain->current) !=
+       g_ptr_array_index(chain->boxes, position))) {
+    InlineBox *ib = g_ptr_array_index(chain->boxes, chain->current);
+    inline_box_queue_draw_focus(ib);
+    ib->focused_object = NULL;
+  }
+  chain->current = position;
+}
+
+/* Tries to focus a focus chain entry of a box. */
+static gboolean
+inline_box_focus_entry (InlineBox *ib, guint position,
+                        GtkDirectionType direction)
+{
+  gpointer object = g_ptr_array_index(ib->focus_chain->objects, position);
+  if (object == NULL) {
+    /* A removed widget */
+    return FALSE;
+  }
+  if (IS_IB_LINK(object)) {
+    if (IB_LINK(object)->end <= IB_LINK(object)->start &&
+        inline_box_link_widget(ib, IB_LINK(object)) < 0) {
+      /* Nothing to focus */
+      return FALSE;
+    }
+    gtk_widget_grab_focus(GTK_WIDGET(ib));
+  } else if (! gtk_widget_child_focus(object, direction)) {
+    return FALSE;
+  }
+  inline_box_queue_draw_focus(ib);
+  ib_focus_chain_set_current(ib->focus_chain, position);
+  ib->focused_object = object;
+  inline_box_queue_draw_focus(ib);
+  return TRUE;
+}
+
+static gboolean
+direction_is_backward (GtkDirectionType direction)
+{
+  return direction == GTK_DIR_TAB_BACKWARD ||
+    direction == GTK_DIR_UP ||
+    direction == GTK_DIR_LEFT;
+}
+
+/* Moves focus to the next (or previous) entry which can be focused,
+   across boxes. Returns FALSE if there are no more entries in that
+   direction, keeping the current position: GTK then asks the focused
+   box to move focus, which finds no more entries in its slice either,
+   unsets it, and lets the focus leave the document. */
+gboolean
+ib_focus_chain_move (IBFocusChain *chain, GtkDirectionType direction)
+{
+  gint step = direction_is_backward(direction) ? -1 : 1;
+  gint position = chain->current;
+  if (position < 0) {
+    position = step > 0 ? -1 : (gint)chain->objects->len;
+  }
+  for (position += step;
+       position >= 0 && position < (gint)chain->objects->len;
+       position += step) {
+    if (inline_box_focus_entry(g_ptr_array_index(chain->boxes, position),
+                               position, direction)) {
+      return TRUE;
     }
   }
   return FALSE;
@@ -205,57 +1024,158 @@ inline_box_focus (GtkWidget        *widget,
                   GtkDirectionType  direction)
 {
   InlineBox *ib = INLINE_BOX(widget);
-  if (ib->children == NULL) {
+  if (ib->focus_chain == NULL || ib->focus_count == 0) {
     return FALSE;
   }
-  GList *ci;
-  guint text_position;
-  gboolean focus_next = FALSE;
-
-  if (ib->focused_object == NULL) {
-    focus_next = TRUE;
+  IBFocusChain *chain = ib->focus_chain;
+  gint first = ib->focus_first, last = first + ib->focus_count - 1;
+  gint step = direction_is_backward(direction) ? -1 : 1;
+  gint position;
+
+  if (chain->current >= first && chain->current <= last) {
+    position = chain->current + step;
+  } else {
+    position = step > 0 ? first : last;
   }
 
   /* todo: allow moving focus inside a single word */
-  for (text_position = 0, ci = ib->children; ci; ci = ci->next) {
-    if (focus_next) {
-      if (GTK_IS_WIDGET(ci->data)) {
-        ib->focused_object = ci->data;
-        if (gtk_widget_child_focus(ci->data, direction)) {
-          gtk_widget_queue_draw(widget);
-          return TRUE;
-        }
-      } else if (ib->links != NULL && IS_IB_TEXT(ci->data)) {
-        GList *li;
-        for (li = ib->links; li; li = li->next) {
-          if (IB_LINK(li->data)->start <=
-              text_position +
-              strlen(pango_layout_get_text(IB_TEXT(ci->data)->layout)) &&
-              IB_LINK(li->data)->end > text_position) {
-            ib->focused_object = li->data;
-            gtk_widget_grab_focus(widget);
-            gtk_widget_queue_draw(widget);
-            return TRUE;
-          }
-        }
-      }
+  for (; position >= first && position <= last; position += step) {
+    if (inline_box_focus_entry(ib, position, direction)) {
+      return TRUE;
     }
-    if (ci->data == ib->focused_object) {
-      focus_next = TRUE;
+  }
+  if (chain->current >= first && chain->current <= last) {
+    ib_focus_chain_set_current(chain, -1);
+  }
+  inline_box_queue_draw_focus(ib);
+  ib->focused_object = NULL;
+  return FALSE;
+}
+
+/* Keeps the focus chain position in sync when a child widget is
+   focused directly, e.g. by clicking it. */
+static void
+inline_box_set_focus_child (GtkContainer *container, GtkWidget *child)
+{
+  InlineBox *ib = INLINE_BOX(container);
+  GTK_CONTAINER_CLASS(inline_box_parent_class)->set_focus_child(container,
+                                                                child);
+  if (child == NULL || ib->focus_chain == NULL ||
+      (gpointer)child == (gpointer)ib->focused_object) {
+    return;
+  }
+  guint position;
+  for (position = ib->focus_first;
+       position < ib->focus_first + ib->focus_count; position++) {
+    if (g_ptr_array_index(ib->focus_chain->objects, position) ==
+        (gpointer)child) {
+      inline_box_queue_draw_focus(ib);
+      ib_focus_chain_set_current(ib->focus_chain, position);
+      ib->focused_object = G_OBJECT(child);
+      return;
+    }
+  }
+}
+
+/* Appends an object to the box's slice of the focus chain. */
+static void
+inline_box_add_focusable (InlineBox *ib, gpointer object)
+{
+  if (ib->focus_chain == NULL) {
+    return;
+  }
+  if (ib->focus_count == 0) {
+    ib->focus_first = ib->focus_chain->objects->len;
+  }
+  g_ptr_array_add(ib->focus_chain->objects, object);
+  g_ptr_array_add(ib->focus_chain->boxes, ib);
+  ib->focus_count++;
+}
+
+/* Adds a link starting at the current end of the text, taking
+   ownership of it. */
+void
+inline_box_add_link (InlineBox *container, IBLink *link)
+{
+  if (container->links_count == container->links_size) {
+    container->links_size = container->links_size > 0
+      ? container->links_size * 2 : 8;
+    container->links = g_renew(IBLink*, container->links,
+                               container->links_size);
+  }
+  container->links[container->links_count++] = link;
+  inline_box_add_focusable(container, link);
+}
+
+/* Marks a widget child, added last, as a part of a link. */
+void
+inline_box_add_link_widget (InlineBox *ib, IBLink *link, GtkWidget *widget)
+{
+  guint i;
+  for (i = ib->children_count; i > 0 && ib->object[i - 1] != widget; i--);
+  if (i == 0) {
+    return;
+  }
+  if (ib->widget_links_count == ib->widget_links_size) {
+    ib->widget_links_size = ib->widget_links_size > 0
+      ? ib->widget_links_size * 2 : 4;
+    ib->widget_links = g_renew(IBWidgetLink, ib->widget_links,
+                               ib->widget_links_size);
+  }
+  ib->widget_links[ib->widget_links_count].child = i - 1;
+  ib->widget_links[ib->widget_links_count].link = g_object_ref(link);
+  ib->widget_links_count++;
+}
+
+/* Finds the link containing a text offset. */
+IBLink *
+inline_box_link_at_offset (InlineBox *ib, guint offset)
+{
+  guint low = 0, high = ib->links_count;
+  /* The first link starting after the offset */
+  while (low < high) {
+    guint mid = (low + high) / 2;
+    if (ib->links[mid]->start <= offset) {
+      low = mid + 1;
+    } else {
+      high = mid;
     }
+  }
+  if (low > 0 && ib->links[low - 1]->end > offset) {
+    return ib->links[low - 1];
+  }
+  return NULL;
+}
 
-    if (IS_IB_TEXT(ci->data)) {
-      text_position +=
-        strlen(pango_layout_get_text(IB_TEXT(ci->data)->layout));
-      if (IS_IB_LINK(ib->focused_object) &&
-          text_position >= IB_LINK(ib->focused_object)->end) {
-        focus_next = TRUE;
+/* Finds the link of a widget child at a point, if any. */
+IBLink *
+inline_box_widget_link_at_point (InlineBox *ib, gint x, gint y)
+{
+  if (ib->widget_links_count == 0 || ib->lines_count == 0) {
+    return NULL;
+  }
+  guint line = inline_box_line_at_y(ib, y);
+  guint i, line_end = (line + 1 < ib->lines_count)
+    ? ib->lines[line + 1].first : ib->children_count;
+  for (i = ib->lines[line].first; i < line_end; i++) {
+    if (ib->kind[i] == IB_CHILD_WIDGET &&
+        x >= ib->x[i] && x <= ib->x[i] + ib->width[i] &&
+        y >= ib->y[i] && y <= ib->y[i] + ib->height[i]) {
+      guint low = 0, high = ib->widget_links_count;
+      while (low < high) {
+        guint mid = (low + high) / 2;
+        if (ib->widget_links[mid].child < i) {
+          low = mid + 1;
+        } else {
+          high = mid;
+        }
+      }
+      if (low < ib->widget_links_count && ib->widget_links[low].child == i) {
+        return ib->widget_links[low].link;
       }
     }
   }
-  ib->focused_object = NULL;
-  gtk_widget_queue_draw(widget);
-  return FALSE;
+  return NULL;
 }
 
 
@@ -274,11 +1194,13 @@ inline_box_class_init (InlineBoxClass *klass)
   widget_class->size_allocate = inline_box_size_allocate;
   widget_class->draw = inline_box_draw;
   widget_class->focus = inline_box_focus;
+  widget_class->style_updated = inline_box_style_updated;
 
   GtkContainerClass *container_class = GTK_CONTAINER_CLASS(klass);
   container_class->child_type = inline_box_child_type;
   container_class->add = inline_box_add;
   container_class->remove = inline_box_remove;
+  container_class->set_focus_child = inline_box_set_focus_child;
   container_class->forall = inline_box_forall;
 }
 
@@ -287,9 +1209,64 @@ inline_box_init (InlineBox *ib)
 {
   gtk_widget_set_has_window(GTK_WIDGET(ib), FALSE);
   gtk_widget_set_can_focus(GTK_WIDGET(ib), TRUE);
-  INLINE_BOX(ib)->children = NULL;
+  INLINE_BOX(ib)->children_count = 0;
+  INLINE_BOX(ib)->children_size = 0;
+  INLINE_BOX(ib)->kind = NULL;
+  INLINE_BOX(ib)->object = NULL;
+  INLINE_BOX(ib)->x = NULL;
+  INLINE_BOX(ib)->y = NULL;
+  INLINE_BOX(ib)->width = NULL;
+  INLINE_BOX(ib)->height = NULL;
+  INLINE_BOX(ib)->baseline = NULL;
+  INLINE_BOX(ib)->offset = NULL;
+  INLINE_BOX(ib)->space = NULL;
+  INLINE_BOX(ib)->text = g_malloc(1);
+  INLINE_BOX(ib)->text[0] = 0;
+  INLINE_BOX(ib)->text_length = 0;
+  INLINE_BOX(ib)->text_size = 1;
+  INLINE_BOX(ib)->folded = NULL;
+  INLINE_BOX(ib)->folded_length = 0;
+  INLINE_BOX(ib)->matches = NULL;
+  INLINE_BOX(ib)->matches_count = 0;
+  INLINE_BOX(ib)->matches_length = 0;
+  INLINE_BOX(ib)->matches_generation = 0;
+  INLINE_BOX(ib)->matches_scanned = 0;
   INLINE_BOX(ib)->links = NULL;
+  INLINE_BOX(ib)->links_count = 0;
+  INLINE_BOX(ib)->links_size = 0;
+  INLINE_BOX(ib)->widget_links = NULL;
+  INLINE_BOX(ib)->widget_links_count = 0;
+  INLINE_BOX(ib)->widget_links_size = 0;
   INLINE_BOX(ib)->focused_object = NULL;
+  INLINE_BOX(ib)->focus_chain = NULL;
+  INLINE_BOX(ib)->focus_first = 0;
+  INLINE_BOX(ib)->focus_count = 0;
+  INLINE_BOX(ib)->run_glyphs = NULL;
+  INLINE_BOX(ib)->run_glyphs_size = 0;
+  INLINE_BOX(ib)->text_shadow = FALSE;
+  INLINE_BOX(ib)->document_index = 0;
+  INLINE_BOX(ib)->lines = NULL;
+  INLINE_BOX(ib)->lines_count = 0;
+  INLINE_BOX(ib)->lines_size = 0;
+  INLINE_BOX(ib)->lines_width = -1;
+  INLINE_BOX(ib)->lines_x0 = 0;
+  INLINE_BOX(ib)->lines_y0 = 0;
+  INLINE_BOX(ib)->widgets_count = 0;
+  INLINE_BOX(ib)->first_widget = G_MAXUINT;
+  INLINE_BOX(ib)->bands = NULL;
+  INLINE_BOX(ib)->bands_count = 0;
+  INLINE_BOX(ib)->bands_generation = 0;
+  INLINE_BOX(ib)->generation = 1;
+  INLINE_BOX(ib)->width_cache_generation = 0;
+  INLINE_BOX(ib)->height_cache_next = 0;
+  INLINE_BOX(ib)->line_width = 0;
+  INLINE_BOX(ib)->max_line_width = 0;
+  INLINE_BOX(ib)->text_height = 0;
+  INLINE_BOX(ib)->text_baseline = 0;
+  INLINE_BOX(ib)->breaks_count = 0;
+  INLINE_BOX(ib)->text_lines = 0;
+  memset(INLINE_BOX(ib)->height_cache, 0,
+         sizeof(INLINE_BOX(ib)->height_cache));
 }
 
 
@@ -298,8 +1275,6 @@ InlineBox *inline_box_new ()
   InlineBox *ib = INLINE_BOX(g_object_new(inline_box_get_type(), NULL));
   ib->selection_start = 0;
   ib->selection_end = 0;
-  ib->children = NULL;
-  ib->last_child = NULL;
   ib->wrap = TRUE;
   return ib;
 }
@@ -307,27 +1282,50 @@ InlineBox *inline_box_new ()
 static void inline_box_dispose (GObject *object)
 {
   InlineBox *ib = INLINE_BOX(object);
-  if (ib->children != NULL) {
-    GList *il, *next;
-    for (il = ib->children; il; il = next) {
-      next = il->next;
-      if (IS_IB_TEXT(il->data) || IS_IB_BREAK(il->data)) {
-        g_object_unref(il->data);
-        ib->children = g_list_remove(ib->children, il->data);
-      }
+  guint i;
+  /* Widgets are removed by GtkContainer, while texts are only
+     referenced from here: turning those into breaks, which hold no
+     references, since dispose may run more than once. */
+  for (i = 0; i < ib->children_count; i++) {
+    if (ib->kind[i] == IB_CHILD_TEXT) {
+      g_object_unref(ib->object[i]);
+      ib->object[i] = NULL;
+      ib->kind[i] = IB_CHILD_BREAK;
     }
+    g_clear_object(&ib->space[i]);
   }
-  if (ib->links != NULL) {
-    g_list_free_full(ib->links, g_object_unref);
-    ib->links = NULL;
+  for (i = 0; i < ib->links_count; i++) {
+    g_object_unref(ib->links[i]);
   }
+  ib->links_count = 0;
+  for (i = 0; i < ib->widget_links_count; i++) {
+    g_object_unref(ib->widget_links[i].link);
+  }
+  ib->widget_links_count = 0;
+  inline_box_drop_bands(ib);
+  ib->lines_count = 0;
   G_OBJECT_CLASS (inline_box_parent_class)->dispose (object);
 }
 
 static void inline_box_finalize (GObject *object)
 {
   InlineBox *ib = INLINE_BOX(object);
-  g_list_free(ib->children);
+  g_free(ib->kind);
+  g_free(ib->object);
+  g_free(ib->x);
+  g_free(ib->y);
+  g_free(ib->width);
+  g_free(ib->height);
+  g_free(ib->baseline);
+  g_free(ib->offset);
+  g_free(ib->space);
+  g_free(ib->text);
+  g_free(ib->folded);
+  g_free(ib->matches);
+  g_free(ib->links);
+  g_free(ib->widget_links);
+  g_free(ib->lines);
+  g_free(ib->run_glyphs);
   G_OBJECT_CLASS (inline_box_parent_class)->finalize (object);
 }
 
@@ -336,32 +1334,75 @@ static GtkSizeRequestMode inline_box_get_request_mode (GtkWidget *widget)
   return GTK_SIZE_REQUEST_HEIGHT_FOR_WIDTH;
 }
 
+/* Child widgets may change their sizes without notifying the
+   container, so measurements involving them are only reused within a
+   single frame. Returns -1 if they can't be reused at all. */
+static gint64
+inline_box_measure_frame (InlineBox *ib)
+{
+  if (ib->widgets_count == 0) {
+    return 0;
+  }
+  GdkFrameClock *frame_clock = gtk_widget_get_frame_clock(GTK_WIDGET(ib));
+  if (frame_clock == NULL) {
+    return -1;
+  }
+  return gdk_frame_clock_get_frame_counter(frame_clock);
+}
+
+/* Should be called on any change of children. */
+static void
+inline_box_children_changed (InlineBox *ib)
+{
+  ib->generation++;
+  gtk_widget_queue_resize(GTK_WIDGET(ib));
+}
+
+/* Non-wrapping boxes with texts of the same height only, which is
+   the common case for <pre>, are laid out as a stack of fixed-height
+   lines, usually a single text each. */
+static gboolean
+inline_box_is_preformatted (InlineBox *ib)
+{
+  return (! ib->wrap) && ib->widgets_count == 0 && ib->text_height >= 0;
+}
+
 static void
 inline_box_get_preferred_width(GtkWidget *widget, gint *minimal, gint *natural)
 {
-  GList *child;
+  InlineBox *ib = INLINE_BOX(widget);
+  if (inline_box_is_preformatted(ib)) {
+    *minimal = ib->max_line_width;
+    *natural = ib->max_line_width;
+    return;
+  }
+  gint64 frame = inline_box_measure_frame(ib);
+  if (ib->width_cache_generation == ib->generation &&
+      frame >= 0 && ib->width_cache_frame == frame) {
+    *minimal = ib->min_width;
+    *natural = ib->nat_width;
+    return;
+  }
+
+  guint i;
   gint child_min, child_nat, cur_natural;
   *minimal = 0;
   *natural = 0;
   cur_natural = 0;
-  for(child = INLINE_BOX(widget)->children; child; child = child->next) {
-    if (GTK_IS_WIDGET(child->data)) {
-      gtk_widget_get_preferred_width(GTK_WIDGET(child->data),
+  for (i = 0; i < ib->children_count; i++) {
+    if (ib->kind[i] == IB_CHILD_WIDGET) {
+      gtk_widget_get_preferred_width(GTK_WIDGET(ib->object[i]),
                                      &child_min, &child_nat);
       if (*minimal < child_min) {
         *minimal = child_min;
       }
       cur_natural += child_nat;
-    } else if (IS_IB_TEXT(child->data)) {
-      if (INLINE_BOX(widget)->wrap) {
-        if (IB_TEXT(child->data)->alloc.width > *minimal) {
-          *minimal = IB_TEXT(child->data)->alloc.width;
-        }
-      } else {
-        /* todo */
+    } else if (ib->kind[i] == IB_CHILD_TEXT) {
+      if (ib->wrap && ib->width[i] > *minimal) {
+        *minimal = ib->width[i];
       }
-      cur_natural += IB_TEXT(child->data)->alloc.width;
-    } else if (IS_IB_BREAK(child->data)) {
+      cur_natural += ib->width[i] + inline_box_space_width(ib, i);
+    } else if (ib->kind[i] == IB_CHILD_BREAK) {
       if (cur_natural > *natural) {
         *natural = cur_natural;
       }
@@ -371,144 +1412,297 @@ inline_box_get_preferred_width(GtkWidget *widget, gint *minimal, gint *natural)
   if (cur_natural > *natural) {
     *natural = cur_natural;
   }
-}
-
-static void inline_box_get_preferred_height_for_width(GtkWidget *widget,
-                                                      gint width,
-                                                      gint *minimal,
-                                                      gint *natural)
-{
-  GtkAllocation alloc, child_alloc;
-  GList *child;
-  gint child_min;
-  alloc.x = 0;
-  alloc.y = 0;
-  alloc.width = width;
-  alloc.height = 0;
-  *minimal = 0;
-  if (g_list_length(INLINE_BOX(widget)->children) > 0) {
-    /* todo: would be better to avoid reusing the same function, since
-       it actually allocates child window sizes. */
-    inline_box_size_allocate(widget, &alloc);
-    for(child = INLINE_BOX(widget)->children; child; child = child->next) {
-      child_min = 0;
-      if (GTK_IS_WIDGET(child->data)) {
-        gtk_widget_get_allocation(GTK_WIDGET(child->data), &child_alloc);
-        child_min = child_alloc.y + child_alloc.height;
-      } else if (IS_IB_TEXT(child->data)) {
-        child_min =
-          IB_TEXT(child->data)->alloc.y + IB_TEXT(child->data)->alloc.height;
-      }
-      if (*minimal < child_min) {
-        *minimal = child_min;
-      }
-    }
+  if ((! ib->wrap) && *minimal < *natural) {
+    *minimal = *natural;
   }
-  *natural = *minimal;
+
+  ib->width_cache_generation = ib->generation;
+  ib->width_cache_frame = frame;
+  ib->min_width = *minimal;
+  ib->nat_width = *natural;
 }
 
-/* todo: this function is rather slow on larger books, in part because
-   of pango_layout_get_baseline, which is better to cache. Maybe
-   replace PangoLayout in IBText with its subtype, which would
-   include cached baseline. */
-int line_baseline(GList *iter, int full_width, gboolean wrap) {
+static int
+line_baseline (InlineBox *ib, guint i, int full_width)
+{
   int max_baseline = 0, line_width = 0, cur_baseline = 0;
-  for (; iter && (! IS_IB_BREAK(iter->data)); iter = iter->next) {
-    if (IS_IB_TEXT(iter->data)) {
-      cur_baseline = pango_layout_get_baseline(IB_TEXT(iter->data)->layout);
-      line_width += IB_TEXT(iter->data)->alloc.width;
-    } else if (GTK_IS_WIDGET(iter->data)) {
+  for (; i < ib->children_count && ib->kind[i] != IB_CHILD_BREAK; i++) {
+    if (ib->kind[i] == IB_CHILD_TEXT) {
+      cur_baseline = ib->baseline[i];
+      line_width += ib->width[i];
+    } else if (ib->kind[i] == IB_CHILD_WIDGET) {
       int w;
-      gtk_widget_get_preferred_width(iter->data, &w, NULL);
+      gtk_widget_get_preferred_width(ib->object[i], &w, NULL);
       line_width += w;
     }
-    if (wrap && (line_width > full_width)) {
+    if (ib->wrap && (line_width > full_width)) {
       break;
     }
     if (cur_baseline > max_baseline) {
       max_baseline = cur_baseline;
     }
+    if (ib->kind[i] == IB_CHILD_TEXT) {
+      line_width += inline_box_space_width(ib, i);
+    }
   }
-  max_baseline /= PANGO_SCALE;
   return max_baseline;
 }
 
+/* Starts a new line, setting the previous line's height. */
 static void
-inline_box_size_allocate (GtkWidget *widget, GtkAllocation *allocation)
+inline_box_line_start (InlineBox *ib, guint first, gint y, gint baseline,
+                       gint bottom)
 {
-  gtk_widget_set_allocation(widget, allocation);
+  if (ib->lines_count > 0) {
+    ib->lines[ib->lines_count - 1].height =
+      y - ib->lines[ib->lines_count - 1].y;
+  }
+  if (ib->lines_count == ib->lines_size) {
+    ib->lines_size = ib->lines_size > 0 ? ib->lines_size * 2 : 16;
+    ib->lines = g_renew(IBLine, ib->lines, ib->lines_size);
+  }
+  IBLine *line = &ib->lines[ib->lines_count];
+  line->first = first;
+  line->offset = first < ib->children_count
+    ? ib->offset[first] : ib->text_length;
+  line->y = y;
+  line->height = 0;
+  line->baseline = baseline;
+  line->bottom = bottom - ib->lines_y0;
+  ib->lines_count++;
+}
 
-  unsigned border_width =
-    gtk_container_get_border_width(GTK_CONTAINER(widget));
-  int full_width = allocation->width - 2 * border_width;
-  int extra_width = full_width;
+/* Like inline_box_layout (below), for preformatted boxes. Measurement
+   takes constant time, and allocation is resumed from the last line
+   while the origin is the same. */
+static gint
+inline_box_layout_preformatted (InlineBox *ib, gint x0, gint y0,
+                                gboolean allocate)
+{
+  gint height = ib->text_lines * ib->text_height;
+  if (! allocate) {
+    return height;
+  }
+  guint i = 0, line = 0;
+  if (ib->lines_count > 0 && x0 == ib->lines_x0 && y0 == ib->lines_y0) {
+    ib->lines_count--;
+    i = ib->lines[ib->lines_count].first;
+    line = ib->lines_count;
+  } else {
+    ib->lines_count = 0;
+    ib->lines_x0 = x0;
+    ib->lines_y0 = y0;
+  }
+  ib->lines_width = -1;
+  gint x = x0, y = y0 + line * ib->text_height;
+  inline_box_line_start(ib, i, y, ib->text_baseline, MIN(y, y0 + height));
+  for (; i < ib->children_count; i++) {
+    ib->x[i] = x;
+    ib->y[i] = y;
+    if (ib->kind[i] == IB_CHILD_TEXT) {
+      x += ib->width[i] + inline_box_space_width(ib, i);
+    } else {
+      x = x0;
+      y += ib->text_height;
+      inline_box_line_start(ib, i + 1, y, ib->text_baseline,
+                            MIN(y, y0 + height));
+    }
+  }
+  ib->lines[ib->lines_count - 1].height = ib->text_height;
+  return height;
+}
 
-  int x = allocation->x + border_width;
-  int y = allocation->y + border_width;
-  int line_height = 0, max_baseline;
+/* Lays out the children starting from (x0, y0), returning the
+   lowest bottom edge of the children, relative to y0. Positions of the
+   children and the line table are only updated if allocate is TRUE,
+   otherwise it's just a measurement.
 
-  GList *iter = INLINE_BOX(widget)->children;
+   Children are only appended (removals reset the line table), so
+   the lines before the last one stay the same while the width is the
+   same, and the layout is resumed from the last line then. Widgets
+   may change their sizes without notifying the container though, so
+   that's only done if there are none before the last line. */
+static gint
+inline_box_layout (InlineBox *ib, gint x0, gint y0, gint full_width,
+                   gboolean allocate)
+{
+  if (inline_box_is_preformatted(ib)) {
+    return inline_box_layout_preformatted(ib, x0, y0, allocate);
+  }
 
-  max_baseline = line_baseline(iter, full_width, INLINE_BOX(widget)->wrap);
+  int extra_width = full_width;
+  int x = x0;
+  int y = y0;
+  int line_height = 0, max_baseline, bottom = y0;
+  guint i = 0;
+
+  if (ib->lines_count > 0 && ib->lines_width == full_width &&
+      ib->first_widget >= ib->lines[ib->lines_count - 1].first &&
+      ((! allocate) || (x0 == ib->lines_x0 && y0 == ib->lines_y0))) {
+    IBLine *last = &ib->lines[ib->lines_count - 1];
+    i = last->first;
+    y = y0 + last->y - ib->lines_y0;
+    bottom = y0 + last->bottom;
+    /* Line breaks don't reset line height. */
+    if (i > 0 && ib->kind[i - 1] == IB_CHILD_BREAK) {
+      line_height = ib->lines[ib->lines_count - 2].height;
+    }
+    if (allocate) {
+      ib->lines_count--;
+    }
+  } else if (allocate) {
+    ib->lines_count = 0;
+    ib->lines_width = full_width;
+    ib->lines_x0 = x0;
+    ib->lines_y0 = y0;
+  }
 
-  for(; iter; iter = iter->next) {
-    if (GTK_IS_WIDGET(iter->data)) {
+  max_baseline = line_baseline(ib, i, full_width);
+  if (allocate) {
+    inline_box_line_start(ib, i, y, max_baseline, bottom);
+  }
+
+  for (; i < ib->children_count; i++) {
+    if (ib->kind[i] == IB_CHILD_WIDGET) {
 
-      if(!gtk_widget_get_visible(iter->data))
+      if(!gtk_widget_get_visible(ib->object[i]))
         continue;
 
       GtkAllocation child_allocation;
-      gtk_widget_get_preferred_width(iter->data, &child_allocation.width, NULL);
-      gtk_widget_get_preferred_height(iter->data, &child_allocation.height, NULL);
+      gtk_widget_get_preferred_width(ib->object[i],
+                                     &child_allocation.width, NULL);
+      gtk_widget_get_preferred_height(ib->object[i],
+                                      &child_allocation.height, NULL);
 
       if (extra_width < child_allocation.width && extra_width < full_width) {
-        x = allocation->x + border_width;
+        x = x0;
         y += line_height;
         extra_width = full_width;
         line_height = 0;
-        max_baseline = line_baseline(iter, full_width, INLINE_BOX(widget)->wrap);
+        max_baseline = line_baseline(ib, i, full_width);
+        if (allocate) {
+          inline_box_line_start(ib, i, y, max_baseline, bottom);
+        }
       }
 
       child_allocation.x = x;
       child_allocation.y = y;
-      gtk_widget_size_allocate(iter->data, &child_allocation);
+      if (allocate) {
+        gtk_widget_size_allocate(ib->object[i], &child_allocation);
+        ib->x[i] = child_allocation.x;
+        ib->y[i] = child_allocation.y;
+        ib->width[i] = child_allocation.width;
+        ib->height[i] = child_allocation.height;
+      }
       extra_width -= child_allocation.width;
       x += child_allocation.width;
       line_height = line_height > child_allocation.height
         ? line_height
         : child_allocation.height;
-    } else if (IS_IB_TEXT(iter->data)) {
-      IBText *ibt = IB_TEXT(iter->data);
-      if (INLINE_BOX(widget)->wrap && extra_width < ibt->alloc.width &&
+      if (bottom < y + child_allocation.height) {
+        bottom = y + child_allocation.height;
+      }
+    } else if (ib->kind[i] == IB_CHILD_TEXT) {
+      if (ib->wrap && extra_width < ib->width[i] &&
           extra_width < full_width) {
-        x = allocation->x + border_width;
+        x = x0;
         y += line_height;
         extra_width = full_width;
         line_height = 0;
-        max_baseline = line_baseline(iter, full_width, INLINE_BOX(widget)->wrap);
+        max_baseline = line_baseline(ib, i, full_width);
+        if (allocate) {
+          inline_box_line_start(ib, i, y, max_baseline, bottom);
+        }
+      }
+      int y_offset = max_baseline - ib->baseline[i];
+      if (allocate) {
+        ib->x[i] = x;
+        ib->y[i] = y + y_offset;
+      }
+      if (bottom < y + y_offset + ib->height[i]) {
+        bottom = y + y_offset + ib->height[i];
       }
-      int y_offset = max_baseline - pango_layout_get_baseline(ibt->layout) / PANGO_SCALE;
-      ibt->alloc.x = x;
-      ibt->alloc.y = y + y_offset;
 
-      if ((guint)x == allocation->x + border_width &&
-          INLINE_BOX(widget)->wrap &&
-          strcmp(pango_layout_get_text(IB_TEXT(iter->data)->layout), " ") == 0) {
+      if (x == x0 && ib->wrap && IB_TEXT(ib->object[i])->length == 1 &&
+          ib->text[ib->offset[i]] == ' ') {
         /* A space in the beginning of a line, not in <pre> */
       } else {
-        extra_width -= ibt->alloc.width;
-        x += ibt->alloc.width;
-        line_height = line_height > (ibt->alloc.height + y_offset)
+        /* A trailing space may not fit, but then the next child
+           just goes to the next line. */
+        extra_width -= ib->width[i] + inline_box_space_width(ib, i);
+        x += ib->width[i] + inline_box_space_width(ib, i);
+        line_height = line_height > (ib->height[i] + y_offset)
           ? line_height
-          : (ibt->alloc.height + y_offset);
+          : (ib->height[i] + y_offset);
       }
-    } else if (IS_IB_BREAK(iter->data)) {
-      x = allocation->x + border_width;
+    } else if (ib->kind[i] == IB_CHILD_BREAK) {
+      x = x0;
       y += line_height;
       extra_width = full_width;
-      max_baseline = line_baseline(iter->next, full_width, INLINE_BOX(widget)->wrap);
+      max_baseline = line_baseline(ib, i + 1, full_width);
+      if (allocate) {
+        ib->x[i] = x;
+        ib->y[i] = y;
+        inline_box_line_start(ib, i + 1, y, max_baseline, bottom);
+      }
     }
   }
+  if (allocate) {
+    ib->lines[ib->lines_count - 1].height = line_height;
+  }
+  return bottom - y0;
+}
+
+static void inline_box_get_preferred_height_for_width(GtkWidget *widget,
+                                                      gint width,
+                                                      gint *minimal,
+                                                      gint *natural)
+{
+  InlineBox *ib = INLINE_BOX(widget);
+  gint64 frame = inline_box_measure_frame(ib);
+  guint i;
+  for (i = 0; i < IB_HEIGHT_CACHE_SIZE; i++) {
+    IBHeightCache *hc = &ib->height_cache[i];
+    if (hc->generation == ib->generation && hc->width == width &&
+        frame >= 0 && hc->frame == frame) {
+      *minimal = hc->height;
+      *natural = *minimal;
+      return;
+    }
+  }
+
+  unsigned border_width =
+    gtk_container_get_border_width(GTK_CONTAINER(widget));
+  *minimal = 0;
+  if (ib->children_count > 0) {
+    *minimal = border_width +
+      inline_box_layout(ib, 0, 0, width - 2 * border_width, FALSE);
+  }
+  *natural = *minimal;
+
+  IBHeightCache *hc = &ib->height_cache[ib->height_cache_next];
+  ib->height_cache_next = (ib->height_cache_next + 1) % IB_HEIGHT_CACHE_SIZE;
+  hc->generation = ib->generation;
+  hc->width = width;
+  hc->frame = frame;
+  hc->height = *minimal;
+}
+
+static void
+inline_box_size_allocate (GtkWidget *widget, GtkAllocation *allocation)
+{
+  gtk_widget_set_allocation(widget, allocation);
+  unsigned border_width =
+    gtk_container_get_border_width(GTK_CONTAINER(widget));
+  inline_box_layout(INLINE_BOX(widget),
+                    allocation->x + border_width,
+                    allocation->y + border_width,
+                    allocation->width - 2 * border_width,
+                    TRUE);
+  /* Texts may be moved by child widgets changing their sizes. */
+  if (INLINE_BOX(widget)->widgets_count > 0) {
+    inline_box_drop_bands(INLINE_BOX(widget));
+  }
 }
 
 static GType
@@ -517,28 +1711,101 @@ inline_box_child_type(GtkContainer *container)
   return GTK_TYPE_WIDGET;
 }
 
+/* Appends a child, returning its index. */
+static guint
+inline_box_append_child (InlineBox *ib, IBChildKind kind, gpointer object)
+{
+  if (ib->children_count == ib->children_size) {
+    ib->children_size = ib->children_size > 0 ? ib->children_size * 2 : 16;
+    ib->kind = g_renew(guint8, ib->kind, ib->children_size);
+    ib->object = g_renew(gpointer, ib->object, ib->children_size);
+    ib->x = g_renew(gint, ib->x, ib->children_size);
+    ib->y = g_renew(gint, ib->y, ib->children_size);
+    ib->width = g_renew(gint, ib->width, ib->children_size);
+    ib->height = g_renew(gint, ib->height, ib->children_size);
+    ib->baseline = g_renew(gint, ib->baseline, ib->children_size);
+    ib->offset = g_renew(guint, ib->offset, ib->children_size);
+    ib->space = g_renew(IBText*, ib->space, ib->children_size);
+  }
+  guint i = ib->children_count;
+  ib->kind[i] = kind;
+  ib->object[i] = object;
+  ib->x[i] = 0;
+  ib->y[i] = 0;
+  ib->width[i] = 0;
+  ib->height[i] = 0;
+  ib->baseline[i] = 0;
+  ib->offset[i] = ib->text_length;
+  ib->space[i] = NULL;
+  ib->children_count++;
+  return i;
+}
+
+/* Appends a text to the text buffer. */
+static void
+inline_box_append_text (InlineBox *ib, IBText *text)
+{
+  if (ib->text_length + text->length >= ib->text_size) {
+    while (ib->text_length + text->length >= ib->text_size) {
+      ib->text_size *= 2;
+    }
+    ib->text = g_realloc(ib->text, ib->text_size);
+  }
+  memcpy(ib->text + ib->text_length, pango_layout_get_text(text->layout),
+         text->length);
+  ib->text_length += text->length;
+  ib->text[ib->text_length] = 0;
+}
+
 void inline_box_add_text(InlineBox *container, IBText *text)
 {
-  container->last_child = g_list_append(container->last_child, text);
-  if (container->children == NULL) {
-    container->children = container->last_child;
+  guint i = inline_box_append_child(container, IB_CHILD_TEXT, text);
+  g_object_ref(text);
+  container->width[i] = text->logical.width;
+  container->height[i] = text->logical.height;
+  container->baseline[i] = text->baseline;
+  inline_box_append_text(container, text);
+  container->line_width += text->logical.width;
+  if (container->line_width > container->max_line_width) {
+    container->max_line_width = container->line_width;
   }
-  if (container->last_child->next != NULL) {
-    container->last_child = container->last_child->next;
+  if (container->text_height == 0) {
+    container->text_height = text->logical.height;
+    container->text_baseline = text->baseline;
+  } else if (container->text_height != text->logical.height ||
+             container->text_baseline != text->baseline) {
+    container->text_height = -1;
   }
-  gtk_widget_queue_resize(GTK_WIDGET(container));
+  container->text_lines = container->breaks_count + 1;
+  inline_box_children_changed(container);
 }
 
-void inline_box_break(InlineBox *container)
+/* Attaches a trailing space to the last child, if it's a text without
+   one. Returns FALSE otherwise, then it should be added as a text. */
+gboolean inline_box_add_space(InlineBox *container, IBText *space)
 {
-  container->last_child = g_list_append(container->last_child, ib_break_new());
-  if (container->children == NULL) {
-    container->children = container->last_child;
+  guint i = container->children_count - 1;
+  if (container->children_count == 0 ||
+      container->kind[i] != IB_CHILD_TEXT ||
+      container->space[i] != NULL) {
+    return FALSE;
   }
-  if (container->last_child->next != NULL) {
-    container->last_child = container->last_child->next;
+  container->space[i] = g_object_ref(space);
+  inline_box_append_text(container, space);
+  container->line_width += space->logical.width;
+  if (container->line_width > container->max_line_width) {
+    container->max_line_width = container->line_width;
   }
-  gtk_widget_queue_resize(GTK_WIDGET(container));
+  inline_box_children_changed(container);
+  return TRUE;
+}
+
+void inline_box_break(InlineBox *container)
+{
+  inline_box_append_child(container, IB_CHILD_BREAK, NULL);
+  container->line_width = 0;
+  container->breaks_count++;
+  inline_box_children_changed(container);
 }
 
 
@@ -546,24 +1813,85 @@ static void
 inline_box_add(GtkContainer *container, GtkWidget *widget)
 {
   InlineBox *ib = INLINE_BOX(container);
-  ib->last_child = g_list_append(ib->last_child, widget);
-  if (ib->children == NULL) {
-    ib->children = ib->last_child;
-  }
-  if (ib->last_child->next != NULL) {
-    ib->last_child = ib->last_child->next;
+  guint i = inline_box_append_child(ib, IB_CHILD_WIDGET, widget);
+  if (ib->first_widget == G_MAXUINT) {
+    ib->first_widget = i;
   }
   gtk_widget_set_parent(widget, GTK_WIDGET(container));
+  if (gtk_widget_get_can_focus(widget) || GTK_IS_CONTAINER(widget)) {
+    inline_box_add_focusable(ib, widget);
+  }
+  ib->widgets_count++;
+  ib->generation++;
   if(gtk_widget_get_visible(widget))
     gtk_widget_queue_resize(GTK_WIDGET(container));
 }
 
+/* Updates widget links after removal of a child. */
+static void
+inline_box_remove_widget_link (InlineBox *ib, guint child)
+{
+  guint i, j = 0;
+  for (i = 0; i < ib->widget_links_count; i++) {
+    if (ib->widget_links[i].child == child) {
+      g_object_unref(ib->widget_links[i].link);
+      continue;
+    }
+    ib->widget_links[j] = ib->widget_links[i];
+    if (ib->widget_links[j].child > child) {
+      ib->widget_links[j].child--;
+    }
+    j++;
+  }
+  ib->widget_links_count = j;
+}
+
 static void
 inline_box_remove(GtkContainer *container, GtkWidget *widget)
 {
   InlineBox *ib = INLINE_BOX (container);
+  guint i, n;
   gtk_widget_unparent (widget);
-  ib->children = g_list_remove (ib->children, widget);
+  if (ib->focus_chain != NULL) {
+    for (i = ib->focus_first; i < ib->focus_first + ib->focus_count; i++) {
+      if (g_ptr_array_index(ib->focus_chain->objects, i) == (gpointer)widget) {
+        g_ptr_array_index(ib->focus_chain->objects, i) = NULL;
+      }
+    }
+  }
+  if ((gpointer)widget == (gpointer)ib->focused_object) {
+    ib->focused_object = NULL;
+  }
+  for (i = 0; i < ib->children_count; i++) {
+    if (ib->object[i] == (gpointer)widget) {
+      n = ib->children_count - i - 1;
+      memmove(ib->kind + i, ib->kind + i + 1, n * sizeof(guint8));
+      memmove(ib->object + i, ib->object + i + 1, n * sizeof(gpointer));
+      memmove(ib->x + i, ib->x + i + 1, n * sizeof(gint));
+      memmove(ib->y + i, ib->y + i + 1, n * sizeof(gint));
+      memmove(ib->width + i, ib->width + i + 1, n * sizeof(gint));
+      memmove(ib->height + i, ib->height + i + 1, n * sizeof(gint));
+      memmove(ib->baseline + i, ib->baseline + i + 1, n * sizeof(gint));
+      memmove(ib->offset + i, ib->offset + i + 1, n * sizeof(guint));
+      memmove(ib->space + i, ib->space + i + 1, n * sizeof(IBText*));
+      ib->children_count--;
+      ib->widgets_count--;
+      inline_box_remove_widget_link(ib, i);
+      break;
+    }
+  }
+  for (ib->first_widget = 0;
+       ib->first_widget < ib->children_count &&
+         ib->kind[ib->first_widget] != IB_CHILD_WIDGET;
+       ib->first_widget++);
+  if (ib->first_widget == ib->children_count) {
+    ib->first_widget = G_MAXUINT;
+  }
+  /* Lines refer to children by index, so they are dropped till the
+     next allocation. */
+  ib->lines_count = 0;
+  ib->lines_width = -1;
+  inline_box_children_changed(ib);
 }
 
 static void
@@ -571,65 +1899,368 @@ inline_box_forall (GtkContainer *container, gboolean include_internals,
                    GtkCallback callback, gpointer callback_data)
 {
   InlineBox *ib = INLINE_BOX (container);
-  GList *child, *next;
-  child = ib->children;
-  while (child) {
-    /* Current child can be removed and freed, so better remember the
-       next one before running the callback. */
-    next = child->next;
-    if (child && child->data && GTK_IS_WIDGET(child->data)) {
-      (* callback) (GTK_WIDGET(child->data), callback_data);
+  guint i = 0;
+  while (i < ib->children_count) {
+    if (ib->kind[i] == IB_CHILD_WIDGET) {
+      gpointer child = ib->object[i];
+      (* callback) (GTK_WIDGET(child), callback_data);
+      /* Current child can be removed, then the next one takes its
+         place. */
+      if (i < ib->children_count && ib->object[i] != child) {
+        continue;
+      }
     }
-    child = next;
+    i++;
   }
 }
 
-gchar*
+/* Returns the text of all the children, owned by the box. */
+const gchar *
 inline_box_get_text (InlineBox *ib)
 {
-  GList *child;
-  gchar **words = calloc(g_list_length(ib->children) + 1, sizeof(gchar*));
-  guint n = 0;
-  for (child = ib->children; child; child = child->next) {
-    if (IS_IB_TEXT(child->data)) {
-      words[n] = (gchar*)pango_layout_get_text(IB_TEXT(child->data)->layout);
-      n++;
-    }
-  }
-  gchar *result = g_strjoinv(NULL, words);
-  free(words);
-  return result;
+  return ib->text;
 }
 
 guint
 inline_box_get_text_length (InlineBox *ib)
 {
-  GList *child;
-  guint len = 0;
-  for (child = ib->children; child; child = child->next) {
-    if (IS_IB_TEXT(child->data)) {
-      len += strlen(pango_layout_get_text(IB_TEXT(child->data)->layout));
+  return ib->text_length;
+}
+
+/* Folds case of len bytes of a text into dest, keeping characters
+   whose lowercase forms have different lengths in UTF-8 as they are,
+   so that offsets in folded texts are the same as in original ones. */
+static void
+fold_text (const gchar *src, gchar *dest, gsize len)
+{
+  const gchar *p = src, *end = src + len;
+  while (p < end) {
+    if ((guchar)*p < 0x80) {
+      *(dest++) = g_ascii_tolower(*(p++));
+    } else {
+      const gchar *next = MIN(g_utf8_next_char(p), end);
+      gchar lower[6];
+      gint lower_len =
+        g_unichar_to_utf8(g_unichar_tolower(g_utf8_get_char(p)), lower);
+      if (lower_len == next - p) {
+        memcpy(dest, lower, lower_len);
+      } else {
+        memcpy(dest, p, next - p);
+      }
+      dest += next - p;
+      p = next;
     }
   }
-  return len;
 }
 
+/* Returns a newly allocated case-folded string, to search for. */
+gchar *
+inline_box_fold (const gchar *str)
+{
+  gsize len = strlen(str);
+  gchar *folded = g_malloc(len + 1);
+  fold_text(str, folded, len);
+  folded[len] = 0;
+  return folded;
+}
+
+/* Returns the case-folded text of all the children, owned by the
+   box. Only the text appended since the last call is folded. */
+const gchar *
+inline_box_get_folded_text (InlineBox *ib)
+{
+  if (ib->folded == NULL || ib->folded_length < ib->text_length) {
+    ib->folded = g_realloc(ib->folded, ib->text_size);
+    fold_text(ib->text + ib->folded_length, ib->folded + ib->folded_length,
+              ib->text_length - ib->folded_length);
+    ib->folded_length = ib->text_length;
+    ib->folded[ib->folded_length] = 0;
+  }
+  return ib->folded;
+}
+
+/* Substring search. Candidate positions are found by comparing the
+   first and the last bytes of a string with blocks of a text (using
+   SSE2 or AVX2 where available), and only those are verified. With
+   ASCII folding, ASCII letters are compared case-insensitively, by
+   setting their 0x20 bit in both the text and the string (which is
+   expected to be folded already); that may yield false candidates,
+   which are rejected by verification. */
+
+static inline guchar
+search_fold_mask (gchar c, gboolean ascii_fold)
+{
+  return ascii_fold && g_ascii_isalpha(c) ? 0x20 : 0;
+}
+
+static inline gboolean
+search_match_at (const gchar *text, const gchar *str, gsize len,
+                 gboolean ascii_fold)
+{
+  return ascii_fold
+    ? g_ascii_strncasecmp(text, str, len) == 0
+    : memcmp(text, str, len) == 0;
+}
+
+static const gchar *
+search_scalar (const gchar *text, gsize text_len, gsize from,
+               const gchar *str, gsize len, gboolean ascii_fold)
+{
+  guchar first = str[0], first_mask = search_fold_mask(str[0], ascii_fold);
+  gsize i;
+  for (i = from; i + len <= text_len; i++) {
+    if (((guchar)text[i] | first_mask) == first &&
+        search_match_at(text + i, str, len, ascii_fold)) {
+      return text + i;
+    }
+  }
+  return NULL;
+}
+
+#ifdef IB_SEARCH_X86
+#ifdef __SSE2__
+static const gchar *
+search_sse2 (const gchar *text, gsize text_len, const gchar *str, gsize len,
+             gboolean ascii_fold)
+{
+  const __m128i first = _mm_set1_epi8(str[0]);
+  const __m128i first_mask =
+    _mm_set1_epi8(search_fold_mask(str[0], ascii_fold));
+  const __m128i last = _mm_set1_epi8(str[len - 1]);
+  const __m128i last_mask =
+    _mm_set1_epi8(search_fold_mask(str[len - 1], ascii_fold));
+  gsize i;
+  for (i = 0; i + len + 15 <= text_len; i += 16) {
+    __m128i block_first = _mm_loadu_si128((const __m128i*)(text + i));
+    __m128i block_last =
+      _mm_loadu_si128((const __m128i*)(text + i + len - 1));
+    guint mask = _mm_movemask_epi8
+      (_mm_and_si128
+       (_mm_cmpeq_epi8(_mm_or_si128(block_first, first_mask), first),
+        _mm_cmpeq_epi8(_mm_or_si128(block_last, last_mask), last)));
+    while (mask != 0) {
+      guint bit = __builtin_ctz(mask);
+      if (search_match_at(text + i + bit, str, len, ascii_fold)) {
+        return text + i + bit;
+      }
+      mask &= mask - 1;
+    }
+  }
+  return search_scalar(text, text_len, i, str, len, ascii_fold);
+}
+#endif
+
+__attribute__((target("avx2")))
+static const gchar *
+search_avx2 (const gchar *text, gsize text_len, const gchar *str, gsize len,
+             gboolean ascii_fold)
+{
+  const __m256i first = _mm256_set1_epi8(str[0]);
+  const __m256i first_mask =
+    _mm256_set1_epi8(search_fold_mask(str[0], ascii_fold));
+  const __m256i last = _mm256_set1_epi8(str[len - 1]);
+  const __m256i last_mask =
+    _mm256_set1_epi8(search_fold_mask(str[len - 1], ascii_fold));
+  gsize i;
+  for (i = 0; i + len + 31 <= text_len; i += 32) {
+    __m256i block_first = _mm256_loadu_si256((const __m256i*)(text + i));
+    __m256i block_last =
+      _mm256_loadu_si256((const __m256i*)(text + i + len - 1));
+    guint mask = _mm256_movemask_epi8
+      (_mm256_and_si256
+       (_mm256_cmpeq_epi8(_mm256_or_si256(block_first, first_mask), first),
+        _mm256_cmpeq_epi8(_mm256_or_si256(block_last, last_mask), last)));
+    while (mask != 0) {
+      guint bit = __builtin_ctz(mask);
+      if (search_match_at(text + i + bit, str, len, ascii_fold)) {
+        return text + i + bit;
+      }
+      mask &= mask - 1;
+    }
+  }
+  return search_scalar(text, text_len, i, str, len, ascii_fold);
+}
+#endif
+
+static const gchar *
+search_generic (const gchar *text, gsize text_len, const gchar *str,
+                gsize len, gboolean ascii_fold)
+{
+  return search_scalar(text, text_len, 0, str, len, ascii_fold);
+}
+
+typedef const gchar *(*SearchFunc) (const gchar *text, gsize text_len,
+                                    const gchar *str, gsize len,
+                                    gboolean ascii_fold);
+
+/* The search kernel for this CPU, selected on first use. */
+static SearchFunc search_kernel = NULL;
+
+static SearchFunc
+search_kernel_select (void)
+{
+#ifdef IB_SEARCH_X86
+  if (__builtin_cpu_supports("avx2")) {
+    return search_avx2;
+  }
+#ifdef __SSE2__
+  return search_sse2;
+#endif
+#endif
+  return search_generic;
+}
+
+/* Returns the first occurrence of a string in a text, or NULL. */
+static const gchar *
+search_text (const gchar *text, gsize text_len, const gchar *str, gsize len,
+             gboolean ascii_fold)
+{
+  if (len == 0 || len > text_len) {
+    return NULL;
+  }
+  if (search_kernel == NULL) {
+    search_kernel = search_kernel_select();
+  }
+  return search_kernel(text, text_len, str, len, ascii_fold);
+}
+
+/* Returns the text to search for a given (case-folded) string in:
+   ASCII strings are searched in the original text, folding ASCII
+   letters on the fly, since folding of other characters doesn't
+   produce ASCII ones. Other strings are searched in the folded text. */
+static const gchar *
+inline_box_search_text (InlineBox *ib, const gchar *str, gsize *len,
+                        gboolean *ascii_fold)
+{
+  const gchar *p;
+  for (p = str; *p != 0 && (guchar)*p < 0x80; p++);
+  *len = p - str + strlen(p);
+  *ascii_fold = (*p == 0);
+  return *ascii_fold ? ib->text : inline_box_get_folded_text(ib);
+}
+
+/* Searches for a case-folded string between given offsets (till the
+   end if end is -1), returning the offset of the first match, or -1. */
 gint
 inline_box_search (InlineBox *ib,
                    guint start,
                    gint end,
                    const gchar *str)
 {
-  gchar *orig_text = inline_box_get_text(ib);
-  gchar *text = g_utf8_strdown(orig_text, -1);
-  g_free(orig_text);
-  if (end != -1) {
-    end -= start;
+  gsize len;
+  gboolean ascii_fold;
+  const gchar *text = inline_box_search_text(ib, str, &len, &ascii_fold);
+  if (start > ib->text_length) {
+    return -1;
+  }
+  if (end == -1 || (guint)end > ib->text_length) {
+    end = ib->text_length;
+  }
+  if ((guint)end < start) {
+    return -1;
   }
-  gchar *result = g_strstr_len(text + start, end, str);
-  g_free(text);
+  const gchar *result = search_text(text + start, end - start, str, len,
+                                    ascii_fold);
   if (result != NULL) {
     return result - text;
   }
   return -1;
 }
+
+/* Searches for the last match of a case-folded string starting before
+   a given offset, returning its offset, or -1. Matches are taken from
+   the text's start without overlapping, as inline_box_search finds
+   them when resumed at the end of each match. */
+gint
+inline_box_search_backward (InlineBox *ib,
+                            guint before,
+                            const gchar *str)
+{
+  gsize len;
+  gboolean ascii_fold;
+  const gchar *text = inline_box_search_text(ib, str, &len, &ascii_fold);
+  if (before == 0 || len == 0) {
+    return -1;
+  }
+  gsize end = before > ib->text_length
+    ? ib->text_length : MIN(ib->text_length, before - 1 + len);
+  const gchar *result, *last = NULL, *p = text;
+  while ((result = search_text(p, end - (p - text), str, len, ascii_fold))
+         != NULL) {
+    last = result;
+    p = result + len;
+  }
+  if (last != NULL) {
+    return last - text;
+  }
+  return -1;
+}
+
+IBText *
+inline_box_text_at_point (InlineBox *ib, gint x, gint y, guint *position)
+{
+  if (ib->lines_count == 0) {
+    return NULL;
+  }
+  guint line = inline_box_line_at_y(ib, y);
+  guint i, line_end = (line + 1 < ib->lines_count)
+    ? ib->lines[line + 1].first : ib->children_count;
+  for (i = ib->lines[line].first; i < line_end; i++) {
+    if (ib->kind[i] == IB_CHILD_TEXT &&
+        x >= ib->x[i] &&
+        x <= ib->x[i] + ib->width[i] + inline_box_space_width(ib, i) &&
+        y >= ib->y[i] &&
+        y <= ib->y[i] + ib->height[i]) {
+      IBText *ibt = IB_TEXT(ib->object[i]);
+      gint index;
+      if (x > ib->x[i] + ib->width[i]) {
+        /* In the trailing space */
+        index = ibt->length;
+      } else {
+        pango_layout_xy_to_index(ibt->layout,
+                                 (x - ib->x[i]) * PANGO_SCALE,
+                                 (y - ib->y[i]) * PANGO_SCALE,
+                                 &index,
+                                 NULL);
+      }
+      *position = ib->offset[i] + index;
+      return ibt;
+    }
+  }
+  return NULL;
+}
+
+/* Finds the child containing a given text offset, with a binary
+   search over the children's offsets. Widgets and breaks preceding
+   that text are included, so that the returned child is the first one
+   starting at its offset. */
+guint
+inline_box_find_offset (InlineBox *ib, guint offset)
+{
+  if (ib->children_count == 0) {
+    return 0;
+  }
+  guint low = 0, high = ib->children_count;
+  while (high - low > 1) {
+    guint mid = (low + high) / 2;
+    if (ib->offset[mid] <= offset) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  while (low > 0 && ib->offset[low - 1] == ib->offset[low]) {
+    low--;
+  }
+  return low;
+}
+
+void
+inline_box_get_child_allocation (InlineBox *ib, guint child,
+                                 GtkAllocation *alloc)
+{
+  alloc->x = ib->x[child];
+  alloc->y = ib->y[child];
+  alloc->width = ib->width[child];
+  alloc->height = ib->height[child];
+}
@@ -27,35 +27,39 @@ G_BEGIN_DECLS
 /* inline box text */
 
 /* Using just a GObject for it (and not a GtkWidget), since it's a few
-   times slower with GtkWidget. */
+   times slower with GtkWidget. Texts don't hold their positions, so
+   that they can be shared between all the occurrences of a word (via
+   the word cache); positions are stored in InlineBox. */
 
 #define IB_TEXT_TYPE (ib_text_get_type())
 G_DECLARE_FINAL_TYPE (IBText, ib_text, IB, TEXT, GObject);
 
+/* Metrics are cached at creation time, since querying Pango for
+   those on each layout pass is slow. The baseline is in pixels.
+
+   Texts consisting of a single run with no attributes other than
+   foreground colour also keep their glyphs (positioned relative to
+   the text origin), so that consecutive texts with the same font
+   and colour can be drawn at once. Glyphs are NULL for other texts,
+   which are drawn with Pango. */
 struct _IBText {
   GObject parent_instance;
   PangoLayout *layout;
-  GtkAllocation alloc;
+  gint baseline;
+  PangoRectangle ink;
+  PangoRectangle logical;
+  guint length;
+  cairo_glyph_t *glyphs;
+  guint glyphs_count;
+  PangoFont *font;
+  cairo_scaled_font_t *scaled_font;
+  gboolean has_color;
+  PangoColor color;
 };
 
 #define IS_IB_TEXT(obj)            (G_TYPE_CHECK_INSTANCE_TYPE((obj), IB_TEXT_TYPE))
 
 IBText* ib_text_new (PangoLayout *layout);
-gboolean ib_text_at_point(IBText *ibt, gint x, gint y, gint *position);
-
-
-/* line break */
-
-#define IB_BREAK_TYPE (ib_break_get_type())
-G_DECLARE_FINAL_TYPE (IBBreak, ib_break, IB, BREAK, GObject);
-
-struct _IBBreak
-{
-  GObject parent_instance;
-};
-
-#define IS_IB_BREAK(obj)            (G_TYPE_CHECK_INSTANCE_TYPE((obj), IB_BREAK_TYPE))
-IBBreak *ib_break_new ();
 
 
 
@@ -69,7 +73,6 @@ struct _IBLink
   GObject parent_instance;
   guint start;
   guint end;
-  GList *objects;               /* todo */
   gchar *url;
 };
 
@@ -88,19 +91,167 @@ IBLink *ib_link_new (const gchar *url);
 typedef struct _InlineBox InlineBox;
 typedef struct _InlineBoxClass InlineBoxClass;
 
+typedef enum _IBChildKind IBChildKind;
+enum _IBChildKind {
+  IB_CHILD_TEXT,
+  IB_CHILD_BREAK,
+  IB_CHILD_WIDGET
+};
+
+/* A line, as allocated during the last size allocation. The line
+   spans children from first up to the next line's first child. The
+   bottom is that of the preceding children, relative to the box
+   origin, so that the layout can be resumed from the line. */
+typedef struct _IBLine IBLine;
+struct _IBLine
+{
+  guint first;
+  guint offset;
+  gint y;
+  gint height;
+  gint baseline;
+  gint bottom;
+};
+
+/* Heights measured for given widths, valid while the generation
+   (and the frame, if there are child widgets) is the same. */
+#define IB_HEIGHT_CACHE_SIZE 4
+typedef struct _IBHeightCache IBHeightCache;
+struct _IBHeightCache
+{
+  gint width;
+  gint height;
+  guint generation;
+  gint64 frame;
+};
+
+/* Links and widgets which can be focused, in document order, along
+   with the InlineBoxes they are in, and the current position (or -1).
+   InlineBoxes of a document share a chain, each of them covering a
+   contiguous slice of it, so that focus can be moved and looked up
+   without walking the widget tree. */
+typedef struct _IBFocusChain IBFocusChain;
+struct _IBFocusChain
+{
+  GPtrArray *objects;
+  GPtrArray *boxes;
+  gint current;
+};
+
+IBFocusChain *ib_focus_chain_new (void);
+void ib_focus_chain_free (IBFocusChain *chain);
+gboolean ib_focus_chain_move (IBFocusChain *chain,
+                              GtkDirectionType direction);
+
+/* A widget child inside of a link. */
+typedef struct _IBWidgetLink IBWidgetLink;
+struct _IBWidgetLink
+{
+  guint child;
+  IBLink *link;
+};
+
+/* Rendered texts, in horizontal bands of IB_BAND_HEIGHT pixels. */
+#define IB_BAND_HEIGHT 256
+typedef struct _IBBand IBBand;
+
 struct _InlineBox
 {
   GtkContainer parent_instance;
-  GList *children;
-  GList *last_child;
-  /* It would be cleaner to store links as children, but that would
-     require additional functions to manage children. Keeping a
-     separate list for now; probably it's not worth the complication,
-     and it's only needed to manage/draw focus. */
-  GList *links;
+  /* Children are stored in parallel arrays, indexed by child number,
+     so that the layout and drawing loops only touch what they need.
+     The objects are IBText for texts, GtkWidget for widgets, and NULL
+     for line breaks; the offsets are text offsets at which the
+     children start. Collapsible spaces following texts are not
+     stored as separate children, but as trailing space texts, which
+     are included into the text, but only take horizontal space.
+     The text of all the children is kept in a single NUL-terminated
+     buffer, at the children offsets. */
+  guint children_count;
+  guint children_size;
+  guint8 *kind;
+  gpointer *object;
+  gint *x;
+  gint *y;
+  gint *width;
+  gint *height;
+  gint *baseline;
+  guint *offset;
+  IBText **space;
+  gchar *text;
+  guint text_length;
+  guint text_size;
+  /* Case-folded copy of the text, used for search, folded lazily up
+     to folded_length. */
+  gchar *folded;
+  guint folded_length;
+  IBLine *lines;
+  guint lines_count;
+  guint lines_size;
+  gint lines_width;
+  gint lines_x0;
+  gint lines_y0;
+  guint widgets_count;
+  guint first_widget;
+  guint generation;
+  IBHeightCache height_cache[IB_HEIGHT_CACHE_SIZE];
+  guint height_cache_next;
+  guint width_cache_generation;
+  gint64 width_cache_frame;
+  gint min_width;
+  gint nat_width;
+  /* Maintained as texts are appended, for non-wrapping boxes without
+     widgets (<pre>): the width of the texts on the last line, the
+     widest line, the text height and baseline if all the texts have
+     the same ones (-1 if they differ, 0 if there are no texts), the
+     number of breaks, and the number of lines up to the last text. */
+  gint line_width;
+  gint max_line_width;
+  gint text_height;
+  gint text_baseline;
+  guint breaks_count;
+  guint text_lines;
+  /* The bands are only valid while the following state is the
+     same as it was when they were rendered. */
+  IBBand **bands;
+  guint bands_count;
+  guint bands_generation;
+  gint bands_width;
+  gint bands_scale;
+  guint bands_selection_start;
+  guint bands_selection_end;
+  gpointer bands_focused_object;
+  guint bands_matches_generation;
+  /* Glyph buffer reused for the runs drawn into bands, and whether
+     the theme draws text shadows, which only gtk_render_layout does
+     (glyph runs are not used then). */
+  cairo_glyph_t *run_glyphs;
+  guint run_glyphs_size;
+  gboolean text_shadow;
+  /* Links sorted by their start offsets, and widget children which
+     are in links, sorted by child index: both are appended in that
+     order as the box is built, and looked up with binary searches. */
+  IBLink **links;
+  guint links_count;
+  guint links_size;
+  IBWidgetLink *widget_links;
+  guint widget_links_count;
+  guint widget_links_size;
   GObject *focused_object;
+  IBFocusChain *focus_chain;
+  guint focus_first;
+  guint focus_count;
+  /* Position in the document's box index */
+  guint document_index;
   guint selection_start;
   guint selection_end;
+  /* Search matches to highlight: sorted offsets of matches of the same
+     length, and the length of the text they were searched in. */
+  guint *matches;
+  guint matches_count;
+  guint matches_length;
+  guint matches_generation;
+  guint matches_scanned;
   gboolean wrap;
 };
 
@@ -112,10 +263,31 @@ struct _InlineBoxClass
 GType inline_box_get_type (void) G_GNUC_CONST;
 InlineBox *inline_box_new (void);
 void inline_box_add_text (InlineBox *container, IBText *text);
+gboolean inline_box_add_space (InlineBox *container, IBText *space);
 void inline_box_break (InlineBox *container);
-gchar *inline_box_get_text (InlineBox *ib);
+void inline_box_add_link (InlineBox *container, IBLink *link);
+void inline_box_add_link_widget (InlineBox *ib, IBLink *link,
+                                 GtkWidget *widget);
+IBLink *inline_box_link_at_offset (InlineBox *ib, guint offset);
+IBLink *inline_box_widget_link_at_point (InlineBox *ib, gint x, gint y);
+const gchar *inline_box_get_text (InlineBox *ib);
+gchar *inline_box_fold (const gchar *str);
+const gchar *inline_box_get_folded_text (InlineBox *ib);
 gint inline_box_search (InlineBox *ib, guint start, gint end, const gchar *str);
+gint inline_box_search_backward (InlineBox *ib, guint before,
+                                 const gchar *str);
 guint inline_box_get_text_length (InlineBox *ib);
+IBText *inline_box_text_at_point (InlineBox *ib, gint x, gint y,
+                                  guint *position);
+guint inline_box_find_offset (InlineBox *ib, guint offset);
+void inline_box_queue_draw_range (InlineBox *ib, guint start, guint end);
+void inline_box_set_selection (InlineBox *ib, guint start, guint end);
+void inline_box_set_matches (InlineBox *ib, guint *matches, guint count,
+                             guint length);
+guint inline_box_child_length (InlineBox *ib, guint child);
+void inline_box_get_child_allocation (InlineBox *ib, guint child,
+                                      GtkAllocation *alloc);
+void inline_box_set_render_cache_size (gsize size);
 
 G_END_DECLS
 
@@ -20,14 +20,38 @@
 #include "browserbox.h"
 
 gchar **start_uri = NULL;
+gint render_cache_size = 0;
 
 static GOptionEntry entries[] =
 {
+  { "render-cache", 'r', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+    &render_cache_size, "Rendered text cache size, in MiB (0 to disable)",
+    "SIZE" },
   { G_OPTION_REMAINING, 0, G_OPTION_FLAG_NONE,
     G_OPTION_ARG_STRING_ARRAY, &start_uri, "URI", NULL },
   { NULL }
 };
 
+/* Searches for the current search string, as typed so far. */
+static void
+search_update (BrowserBox *bb, DocumentBox *db)
+{
+  gboolean forward = (bb->search_state == SEARCH_FORWARD);
+  bb->search_matches = -1;
+  bb->search_invalid = FALSE;
+  if (bb->search_regex) {
+    GError *err = NULL;
+    document_box_find_regex(db, bb->search_string, forward, &err);
+    if (err != NULL) {
+      bb->search_invalid = TRUE;
+      g_error_free(err);
+    }
+  } else {
+    document_box_find(db, bb->search_string, forward);
+  }
+  browser_box_display_search_status(bb);
+}
+
 static gboolean
 key_press_event_cb (GtkWidget *widget, GdkEventKey *ev, GtkStack *tabs)
 {
@@ -45,19 +69,22 @@ key_press_event_cb (GtkWidget *widget, GdkEventKey *ev, GtkStack *tabs)
         gtk_widget_destroy(current_tab);
         return TRUE;
       }
-    } else if (ev->keyval == GDK_KEY_s) {
+    } else if (ev->keyval == GDK_KEY_s || ev->keyval == GDK_KEY_r) {
       GtkWidget *current_tab = gtk_stack_get_visible_child(tabs);
       if (current_tab != NULL) {
         BrowserBox *bb = BROWSER_BOX(current_tab);
+        gboolean forward = (ev->keyval == GDK_KEY_s);
         if (bb->search_state == SEARCH_INACTIVE) {
-          bb->search_state = SEARCH_FORWARD;
+          bb->search_state = forward ? SEARCH_FORWARD : SEARCH_BACKWARD;
+          /* C-M-s and C-M-r search for regular expressions */
+          bb->search_regex = (ev->state & GDK_MOD1_MASK) != 0;
+          bb->search_invalid = FALSE;
           browser_box_display_search_status(bb);
-        } else if (bb->search_state == SEARCH_FORWARD) {
-          TextSearchState *tss = &(DOCUMENT_BOX(bb->builder_state->docbox)->search);
-          if (tss->state == FOUND) {
-            tss->start++;
-          }
-          document_box_find(DOCUMENT_BOX(bb->builder_state->docbox), bb->search_string);
+        } else if (bb->builder_state != NULL &&
+                   bb->builder_state->docbox != NULL) {
+          bb->search_state = forward ? SEARCH_FORWARD : SEARCH_BACKWARD;
+          document_box_find_next(DOCUMENT_BOX(bb->builder_state->docbox),
+                                 forward);
           browser_box_display_search_status(bb);
         }
         return TRUE;
@@ -69,6 +96,12 @@ key_press_event_cb (GtkWidget *widget, GdkEventKey *ev, GtkStack *tabs)
         if (bb->search_state != SEARCH_INACTIVE) {
           bb->search_state = SEARCH_INACTIVE;
           bb->search_string[0] = 0;
+          bb->search_matches = -1;
+          if (bb->builder_state != NULL &&
+              bb->builder_state->docbox != NULL) {
+            document_box_find_stop
+              (DOCUMENT_BOX(bb->builder_state->docbox));
+          }
           browser_box_set_status(bb, "Interrupted");
         }
       }
@@ -91,8 +124,7 @@ key_press_event_cb (GtkWidget *widget, GdkEventKey *ev, GtkStack *tabs)
       if (ev->keyval == GDK_KEY_BackSpace && ss_len > 0) {
         /* todo: this won't work well for unicode */
         bb->search_string[ss_len - 1] = 0;
-        document_box_find(db, bb->search_string);
-        browser_box_display_search_status(bb);
+        search_update(bb, db);
         return TRUE;
       }
       if (ss_len + 4 < MAX_SEARCH_STRING_LEN) {
@@ -100,8 +132,7 @@ key_press_event_cb (GtkWidget *widget, GdkEventKey *ev, GtkStack *tabs)
         gint c_len = g_unichar_to_utf8(c, bb->search_string + ss_len);
         if (c_len > 0) {
           bb->search_string[ss_len + c_len] = 0;
-          browser_box_display_search_status(bb);
-          document_box_find(db, bb->search_string);
+          search_update(bb, db);
           return TRUE;
         }
       }
@@ -175,6 +206,9 @@ main (int argc, char **argv)
     g_print("Failed to parse arguments: %s\n", error->message);
     exit(1);
   }
+  if (render_cache_size > 0) {
+    inline_box_set_render_cache_size((gsize)render_cache_size << 20);
+  }
 
   app = gtk_application_new (NULL, G_APPLICATION_FLAGS_NONE);
   g_signal_connect (app, "activate", G_CALLBACK (activate), NULL);